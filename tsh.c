@@ -2,7 +2,9 @@
  * tsh - A tiny shell program with job control
  * 
  */
+#define _GNU_SOURCE         /* ppoll, memfd_create */
 #include <stdio.h>
+#include <stdarg.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
@@ -12,27 +14,90 @@
 #include <sys/wait.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/resource.h>
+#include <dirent.h>
+#include <poll.h>
+#include <time.h>
+#include <stdint.h>
+#include <getopt.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#if defined(__SSE2__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
 
 /* Misc manifest constants */
-#define MAXLINE    1024   /* max line size */
-#define MAXARGS     128   /* max args on a command line */
-#define MAXJOBS      16   /* max jobs at any point in time */
+#define MAXLINE    1024   /* size of sbuf; command lines have no limit */
+#define MAXJOBS    4096   /* max jobs (including scheduled ones) at any point in time */
 
 /* Job states */
 #define UNDEF 0 /* undefined */
 #define FG 1    /* running in foreground */
 #define BG 2    /* running in background */
 #define ST 3    /* stopped */
+#define SC 4    /* scheduled by after/every, no process yet */
+#define PD 5    /* pending: waiting for other jobs to finish */
 #define TRUE 1
 #define FALSE 0
 
+/* Script AST node types */
+#define N_CMD   1   /* simple command (possibly a pipeline) */
+#define N_IF    2   /* if/then/elif/else/fi */
+#define N_FOR   3   /* for name in words; do list; done */
+#define N_WHILE 4   /* while list; do list; done */
+#define N_FUNC  5   /* name() { list; } */
+
+/* parse_script return codes */
+#define P_OK         0
+#define P_INCOMPLETE 1   /* ran out of input inside a construct or quote */
+#define P_ERROR      2   /* syntax error */
+
+/* Token types returned by the script lexer */
+#define T_EOF   0
+#define T_WORD  1
+#define T_SEP   2   /* ';' or newline */
+
+/* Timer kinds */
+#define TM_NONE  0
+#define TM_AFTER 1  /* after: launch the job once */
+#define TM_EVERY 2  /* every: launch a copy of the job each period */
+#define TM_TERM  3  /* timeout: deadline passed, send SIGTERM */
+#define TM_KILL  4  /* timeout: grace period over, send SIGKILL */
+
+/* Hierarchical timer wheel: TW_LEVELS wheels of TW_SIZE slots */
+#define TICK_MS      10   /* timer resolution */
+#define TW_BITS       6
+#define TW_SIZE      (1 << TW_BITS)
+#define TW_MASK      (TW_SIZE - 1)
+#define TW_LEVELS     4   /* covers 2^24 ticks, about 46 hours */
+#define KILL_GRACE 5000   /* ms between timeout's SIGTERM and SIGKILL */
+
+#define QUOTE_ESC '\001' /* marks a '$' that was inside single quotes */
+#define SUBST_DQ  '\002' /* marks a $(...), $@ or $* inside double quotes */
+#define FIELD_SEP '\003' /* where an expanded $(...) splits into words */
+#define VARHASH     64   /* buckets in the shell variable table */
+#define PROCHASH  1024   /* buckets in jstat's process table */
+#define SNAP_MAGIC "TSHSNAP4" /* first bytes of a snapshot image */
+#define SNAP_BASE 0x200000000000UL /* where every snapshot image is mapped */
+#define SNAP_DEPTH 1000  /* deepest node nesting a snapshot may have */
+#define MAXFUNCNEST 1000  /* shell function calls in progress */
+#define PERF_NSW     4   /* perfstat: software events, then hardware */
+#define PERF_NEVENTS 7
+
 /* 
- * Jobs states: FG (foreground), BG (background), ST (stopped)
+ * Jobs states: FG (foreground), BG (background), ST (stopped),
+ *     SC (scheduled), PD (pending)
  * Job state transitions and enabling actions:
  *     FG -> ST  : ctrl-z
  *     ST -> FG  : fg command
  *     ST -> BG  : bg command
  *     BG -> FG  : fg command
+ *     SC -> BG  : after timer fires (every launches a new BG job)
+ *     PD -> BG  : the jobs it waits on have finished
  * At most 1 job can be in the FG state.
  */
 
@@ -42,24 +107,255 @@ char prompt[] = "tsh> ";    /* command line prompt (DO NOT CHANGE) */
 int verbose = 0;            /* if true, print additional output */
 char sbuf[MAXLINE];         /* for composing sprintf messages */
 
+struct wtimer_t {           /* A timer on the wheel */
+    int kind;               /* TM_NONE, TM_AFTER, TM_EVERY, TM_TERM or TM_KILL */
+    unsigned long expires;  /* tick it fires on */
+    unsigned long period;   /* TM_EVERY: ticks between runs; TM_TERM: grace */
+    struct job_t *job;      /* job the timer belongs to */
+    struct wtimer_t *next;  /* wheel slot list */
+    struct wtimer_t **pprev;/* NULL when not on the wheel */
+};
+
+struct dep_t {              /* Edge of the job dependency graph */
+    struct job_t *job;      /* job at the other end */
+    unsigned seq;           /* its seq when the edge was made */
+    struct dep_t *next;
+};
+
 struct job_t {              /* Per-job data */
-    pid_t pid;              /* job PID */
+    pid_t pid;              /* job PID (0 while scheduled or pending) */
     int jid;                /* job ID [1, 2, ...] */
-    int state;              /* UNDEF, FG, BG, or ST */
-    char cmdline[MAXLINE];  /* command line */
+    int state;              /* UNDEF, FG, BG, ST, SC or PD */
+    char *cmdline;          /* command line, kept for reuse by the slot */
+    size_t cmdcap;          /* size of cmdline */
+    char **argv;            /* SC/PD: command to launch, ends in "&" */
+    char *lit;              /* ... and which of its words are literal */
+    struct wtimer_t timer;  /* after/every/timeout timer */
+    unsigned seq;           /* tells reuses of the slot apart */
+    int waiting;            /* PD: prerequisites still unfinished */
+    int okafter;            /* PD: run only if they all succeed */
+    int failed;             /* PD: one of them didn't */
+    int queued;             /* on the ready list */
+    struct dep_t *prereqs;  /* PD: jobs it waits on */
+    struct dep_t *dependents; /* jobs waiting on this one */
+    struct job_t *ready_next; /* ready list */
+    struct perf_t *perf;    /* perfstat's counters, if any */
 };
 struct job_t jobs[MAXJOBS]; /* The job list */
+unsigned jobseq;            /* seq of the newest job */
+struct job_t *ready_jobs;   /* PD jobs whose prerequisites are settled */
+struct dep_t *dead_deps;    /* edges the handler unlinked, freed later */
+struct job_t *launch_into;  /* slot the next background launch takes over */
+const char *argv_lit;       /* lit flags of the running builtin's argv */
+
+struct wheel_t {            /* The timer wheel */
+    unsigned long now;      /* next tick to process */
+    int count;              /* timers on the wheel */
+    struct wtimer_t *slot[TW_LEVELS][TW_SIZE];
+};
+struct wheel_t wheel;
+int timer_fd = -1;          /* timerfd that wakes us for the wheel */
+struct timespec epoch;      /* CLOCK_MONOTONIC time of tick 0 */
+unsigned long launch_deadline; /* timeout: ticks the next launch may run */
+unsigned long launch_grace;    /* timeout: ticks from SIGTERM to SIGKILL */
 
 volatile sig_atomic_t ready; /* Is the newest child in its own process group? */
 
+volatile sig_atomic_t fg_status;   /* exit status of the last reaped fg job */
+volatile sig_atomic_t interrupted; /* ctrl-c seen since the last prompt */
+int last_status = 0;               /* $? - status of the last command */
+int subshell = 0;                  /* running a <(...) or >(...) command */
+int notice_fd = -1;                /* where job notices go while $(...)
+                                      has stdout, or -1 */
+
+struct strbuf_t {           /* Growable string */
+    char *s;
+    size_t len;
+    size_t cap;
+};
+
+struct redir_t {            /* What one fd of a child ends up as */
+    int fd;                 /* the child's descriptor */
+    int src;                /* descriptor to dup2 onto it, -1 to close it */
+    char *proc;             /* or the text of a <(...)/>(...) to start */
+    int dir;                /* ... and its direction, '<' or '>' */
+};
+
+struct cmd_t {              /* A simple command, tokenized once */
+    int argc;               /* number of words */
+    char **argv;            /* words with quotes removed */
+    char *lit;              /* per word: never an operator (some of it
+                               was quoted or came from a $) */
+    int expand;             /* some word contains a '$' */
+    char *text;             /* source text for the job list */
+    int cap;                /* room in argv */
+};
+
+struct node_t {             /* Parsed script AST */
+    int type;               /* N_CMD, N_IF, N_FOR or N_WHILE */
+    struct node_t *next;    /* next node in the list */
+    struct cmd_t cmd;       /* N_CMD: the command; N_FOR: name + words */
+    struct node_t *cond;    /* N_IF/N_WHILE: condition list */
+    struct node_t *body;    /* then/do list */
+    struct node_t *alt;     /* N_IF: else list (elif is a nested N_IF) */
+};
+
+struct var_t {              /* Shell variable */
+    char *name;
+    char *value;
+    struct var_t *next;     /* hash chain */
+};
+struct var_t *vartab[VARHASH]; /* The variable table */
+
+struct script_t {           /* A sourced file, parsed once */
+    char *path;
+    struct timespec mtime;  /* st_mtim when it was parsed */
+    off_t size;             /* st_size when it was parsed */
+    struct node_t *ast;
+    int busy;               /* being executed right now */
+    struct script_t *next;
+};
+struct script_t *scripts;   /* The source cache */
+
+struct def_t {              /* A shell function or alias, parsed once */
+    char *name;
+    char *text;             /* alias: its value as given */
+    struct node_t *ast;     /* function body, or what the alias runs */
+    int refs;               /* the table's, plus one per run in progress */
+    struct def_t *next;     /* hash chain */
+};
+struct def_t *functab[VARHASH];  /* Shell functions, bucketed like vartab */
+struct def_t *aliastab[VARHASH]; /* Aliases, likewise */
+
+struct local_t {            /* A variable the running function made local */
+    char *name;
+    char *saved;            /* its value outside, NULL if it had none */
+    struct local_t *next;
+};
+struct local_t *locals;     /* locals of the innermost function call */
+int posc;                   /* $#: the innermost function's arguments, */
+char **posv;                /*   $1 to $posc in posv[1..posc] */
+int funcdepth;              /* function calls in progress */
+int returning;              /* return ran: unwind to the function call */
+
+struct subst_t {            /* The text of a $(...), parsed once */
+    char *text;
+    struct node_t *ast;
+    struct subst_t *next;   /* hash chain */
+};
+struct subst_t *substtab[VARHASH]; /* The $(...) cache, bucketed like vartab */
+
+struct perf_t {             /* perfstat's counters for one job */
+    int jid;
+    char *cmdline;          /* without the newline */
+    int ntasks;             /* threads counted */
+    int (*fd)[PERF_NEVENTS];/* per thread; -1 where an event didn't open */
+    struct timespec start;  /* when counting began */
+    struct timespec end;    /* when the job was reaped */
+    struct perf_t *next;    /* perf_done list */
+};
+struct perf_t *perf_done;   /* counters of reaped jobs, not yet printed */
+int launch_perf;            /* perfstat: count the next launch */
+
+struct proc_t {             /* A process seen by jstat */
+    pid_t pid;
+    struct job_t *job;      /* job whose process group it is in, or NULL */
+    int stat_fd;            /* /proc/<pid>/stat, statm and io, kept open */
+    int statm_fd;           /*   and reread with pread; -1 when job is NULL */
+    int io_fd;
+    unsigned long long cpu; /* utime + stime at the last sample */
+    unsigned long long when;/* clock ticks since boot at the last sample */
+    double pct;             /* CPU% as of the last sample */
+    unsigned gen;           /* last /proc scan that listed it */
+    struct proc_t *next;    /* hash chain */
+};
+struct proc_t *proctab[PROCHASH]; /* jstat's process table */
+struct rlimit nofile_limit; /* RLIMIT_NOFILE before jstat raised it */
+int nofile_raised;          /* ... which jobs get back */
+
+struct jstat_t {            /* Per-job totals from one jstat sample */
+    double cpu;             /* percent of one CPU */
+    unsigned long long rss; /* bytes resident */
+    unsigned long long rchar; /* bytes read */
+    unsigned long long wchar; /* bytes written */
+    int threads;
+};
+
+/*
+ * A snapshot image is one block of memory, always mapped at SNAP_BASE.
+ * Its own records refer to each other by their offset from the start,
+ * offset 0 (the header) standing for NULL. The parsed trees in it are
+ * plain node_t lists whose pointers already hold their addresses at
+ * SNAP_BASE, so they run in place like any other tree.
+ */
+struct snap_file {          /* Identity of a file an image depends on */
+    uint64_t dev;
+    uint64_t ino;
+    uint64_t size;
+    int64_t sec;            /* st_mtim */
+    int64_t nsec;
+};
+
+struct snap_hdr {           /* Start of a snapshot image */
+    char magic[8];          /* SNAP_MAGIC */
+    uint32_t size;          /* of the whole image */
+    uint32_t varhash;       /* VARHASH when it was written */
+    struct snap_file rc;    /* the rc file whose effects it holds */
+    struct snap_file exe;   /* the tsh binary that wrote it */
+    uint32_t rcpath;        /* string: path of the rc file */
+    uint32_t scripts;       /* snap_script list: the source cache */
+    uint32_t funcs;         /* snap_def list: shell functions */
+    uint32_t aliases;       /* snap_def list: aliases */
+    uint32_t vars[VARHASH]; /* snap_var chains, bucketed like vartab */
+};
+
+struct snap_var {           /* A shell variable in an image */
+    uint32_t name;
+    uint32_t value;
+    uint32_t next;
+};
+
+struct snap_script {        /* A source cache entry in an image */
+    uint32_t path;
+    uint32_t ast;           /* node_t list */
+    uint32_t next;
+    uint32_t pad;
+    int64_t sec;            /* the file's st_mtim and st_size */
+    int64_t nsec;
+    int64_t size;
+};
+
+struct snap_def {           /* A function or alias in an image */
+    uint32_t name;
+    uint32_t text;
+    uint32_t ast;           /* node_t list */
+    uint32_t next;
+};
+
+const struct snap_hdr *snap; /* The mapped snapshot, or NULL */
+#define SNAP_AT(off) ((const char *)snap + (off))
+/* Is p part of the mapped snapshot? */
+#define SNAP_HAS(p) (snap && (const char *)(p) >= (const char *)snap && \
+                     (const char *)(p) < (const char *)snap + snap->size)
+
+/* Is word i of an argv with lit flags (or none) never an operator? */
+#define IS_LIT(lit, i) ((lit) && (lit)[i])
+
+struct heredoc_t {          /* A here-document still waiting for its end */
+    char *delim;            /* its terminator, or NULL if there is none */
+    int strip;              /* ... which was opened with <<- */
+};
+
 /* End global variables */
 
 
 /* Function prototypes */
 
 /* Here are the functions that you will implement */
-void eval(char *cmdline);
+int eval(char *cmdline, struct heredoc_t *here);
+void eval_cmd(char *cmdline, int argc, char **argv, const char *lit);
 int builtin_cmd(char **argv);
+int is_builtin(const char *name);
 void do_bgfg(char **argv);
 void waitfg(pid_t pid);
 void sigchld_handler(int sig);
@@ -72,6 +368,7 @@ void sigquit_handler(int sig);
 void sigusr1_handler(int sig);
 
 void clearjob(struct job_t *job);
+void set_cmdline(struct job_t *job, const char *cmdline);
 void initjobs(struct job_t *jobs);
 int freejid(struct job_t *jobs); 
 int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline);
@@ -82,7 +379,82 @@ struct job_t *getjobjid(struct job_t *jobs, int jid);
 int pid2jid(pid_t pid); 
 void listjobs(struct job_t *jobs);
 
+size_t delim_span(const char *str, const char *set);
+size_t delim_span_scalar(const char *str, const char *set);
+int parse_script(const char *text, struct node_t **list, struct heredoc_t *here);
+int heredoc_end(const char *line, const char *delim, int strip);
+int heredoc_fd(const char *body, int newline);
+char *procsub(const char *text, int dir);
+int procsub_fd(const char *text, int dir);
+int redir_op(const char *word, int *fd, const char **op, const char **target);
+int prepare_redirs(char **argv, const char *lit, int argc,
+                   struct redir_t *redirs, int *opened, int *nopened);
+int apply_redirs(struct redir_t *redirs, int n);
+void redir_builtin(char **argv, struct redir_t *redirs, int n);
+void free_nodes(struct node_t *node);
+void exec_list(struct node_t *node);
+void exec_node(struct node_t *node);
+char *expand_word(const char *word);
+const char *subst_end(const char *p);
+void capture(const char *text, struct strbuf_t *sb);
+char *getvar(const char *name);
+void setvar(const char *name, const char *value);
+void do_source(char **argv);
+struct def_t *getdef(struct def_t **tab, const char *name);
+void setdef(struct def_t **tab, const char *name, struct node_t *ast, const char *text);
+int deldef(struct def_t **tab, const char *name);
+void drop_def(struct def_t *def);
+struct node_t *copy_nodes(const struct node_t *node);
+void call_func(struct def_t *func, int argc, char **argv);
+void func_exit(char **argv);
+void do_alias(char **argv);
+void do_unalias(char **argv);
+void do_local(char **argv);
+void do_return(char **argv);
+void do_shift(char **argv);
+void do_schedule(char **argv);
+void do_depend(char **argv);
+void do_timeout(char **argv);
+void do_kill(char **argv);
+void arm_deadline(pid_t pid);
+void add_dep(struct dep_t **list, struct job_t *job);
+void free_deps(struct dep_t *dep);
+void job_done(struct job_t *job, int ok);
+void launch_job(struct job_t *job);
+void launch_ready(void);
+void do_jstat(char **argv);
+void sample_jobs(struct jstat_t *stats);
+void do_perfstat(char **argv);
+struct perf_t *perf_new(int jid, const char *cmdline);
+int perf_attach(struct perf_t *perf, pid_t tid);
+void perf_free(struct perf_t *perf);
+void perf_print(struct perf_t *perf);
+void report_perf(void);
+
+char *rc_path(void);
+void write_snapshot(const char *path, const char *rc);
+int load_snapshot(const char *path, const char *rc);
+const char *snap_getvar(const char *name);
+struct node_t *snap_script(const char *path, struct stat *st);
+void snap_defs(uint32_t off, struct def_t **tab);
+
+unsigned long ticks_now(void);
+void block_sigchld(sigset_t *old);
+void start_timer(struct wtimer_t *t, unsigned long delay);
+void del_timer(struct wtimer_t *t);
+void run_timers(void);
+int parse_duration(const char *str, unsigned long *ticks);
+
+void sb_grow(struct strbuf_t *sb, size_t n);
+void sb_putc(struct strbuf_t *sb, char c);
+void sb_puts(struct strbuf_t *sb, const char *str);
+void sb_putn(struct strbuf_t *sb, const char *str, size_t n);
+char *sb_finish(struct strbuf_t *sb);
+char *join_argv(char **argv, int argc);
+int read_line(struct strbuf_t *line);
+
 void usage(void);
+void notify(const char *fmt, ...);
 void unix_error(char *msg);
 void app_error(char *msg);
 typedef void handler_t(int);
@@ -92,16 +464,24 @@ handler_t *Signal(int signum, handler_t *handler);
  * main - The shell's main routine 
  */
 int main(int argc, char **argv) {
-    char c;
-    char cmdline[MAXLINE];
+    static struct option longopts[] = {
+        {"snapshot", required_argument, NULL, 's'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    int n;
+    struct strbuf_t script = {0}; /* lines of a construct that is still open */
+    struct heredoc_t here = {NULL, 0}; /* ... inside this here-document */
     int emit_prompt = 1; /* emit prompt (default) */
+    char *snapshot = NULL; /* --snapshot: write the post-rc state here */
+    char *rc, *image;
 
     /* Redirect stderr to stdout (so that driver will get all output
      * on the pipe connected to stdout) */
     dup2(STDOUT_FILENO, STDERR_FILENO);
 
     /* Parse the command line */
-    while ((c = getopt(argc, argv, "hvp")) != -1) {
+    while ((c = getopt_long(argc, argv, "hvp", longopts, NULL)) != -1) {
         switch (c) {
             case 'h':             /* print help message */
                 usage();
@@ -112,6 +492,9 @@ int main(int argc, char **argv) {
             case 'p':             /* don't print a prompt */
                 emit_prompt = 0;  /* handy for automatic testing */
                 break;
+            case 's':             /* run the rc file and save the result */
+                snapshot = optarg;
+                break;
             default:
                 usage();
         }
@@ -129,97 +512,120 @@ int main(int argc, char **argv) {
     /* This one provides a clean way to kill the shell */
     Signal(SIGQUIT, sigquit_handler); 
 
+    /* Orphans, such as <(...) commands outliving their job, are
+     * reparented to us so the SIGCHLD handler reaps them */
+    prctl(PR_SET_CHILD_SUBREAPER, 1);
+
     /* Initialize the job list */
     initjobs(jobs);
 
+    /* The timer wheel counts ticks from now */
+    clock_gettime(CLOCK_MONOTONIC, &epoch);
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+        unix_error("timerfd_create error");
+
+    /* Set up the configuration from the rc file, or from $TSH_SNAPSHOT
+     * if that still matches both the rc file and this binary */
+    rc = rc_path();
+    image = getenv("TSH_SNAPSHOT");
+    if (snapshot || !image || !*image || !load_snapshot(image, rc)) {
+        if (rc && access(rc, R_OK) == 0) {
+            char *src[] = {"source", rc, NULL};
+            do_source(src);
+        }
+        else if (snapshot) {
+            printf("tsh: no rc file to snapshot (set TSHRC or create ~/.tshrc)\n");
+            exit(1);
+        }
+    }
+    if (snapshot) {
+        write_snapshot(snapshot, rc);
+        exit(0);
+    }
+
     /* Execute the shell's read/eval loop */
     while (1) {
 
         /* Read command line */
         if (emit_prompt) {
-            printf("%s", prompt);
+            printf("%s", script.len ? "> " : prompt);
             fflush(stdout);
         }
-        if ((fgets(cmdline, MAXLINE, stdin) == NULL) && ferror(stdin))
-            app_error("fgets error");
-        if (feof(stdin)) { /* End of file (ctrl-d) */
+        /* Lines are appended, so an open if/for/while keeps collecting */
+        if (!(n = read_line(&script))) { /* End of file (ctrl-d) */
+            if (script.len)
+                printf("syntax error: unexpected end of file\n");
             fflush(stdout);
             exit(0);
         }
 
+        /* Inside a here-document only its terminator can change anything,
+         * so don't reparse the whole thing for every line of the body */
+        if (here.delim) {
+            if (!heredoc_end(script.s + script.len - n, here.delim, here.strip))
+                continue;
+            free(here.delim);
+            here.delim = NULL;
+        }
+
         /* Evaluate the command line */
-        eval(cmdline);
+        interrupted = 0;
+        if (!eval(script.s, &here))
+            script.len = 0;
         fflush(stdout);
     } 
 
     exit(0); /* control never reaches here */
 }
   
-/* pipe_tokenizer - takes a string as input, and splits it into an array of strings 
- * based on any '|'.
+/* pipe_tokenizer - takes an argv as input, and splits it into an array of
+ * commands based on any unquoted "|" word (lit says which words were
+ * quoted; NULL if none). Each "|" is replaced by NULL so every
+ * element of output is itself a NULL terminated argv.
  *
  * Returns the number of elements in the array
 */
-int pipe_tokenizer(const char *cmdline, char **output){
-    char array[MAXLINE]; // A local copy of the command line
-    strcpy(array, cmdline); // Copy the cmdline to array
+int pipe_tokenizer(char **argv, const char *lit, char ***output){
     int i = 0;
-    char *delimiter = "|";
-    char *token;
-    token = strtok(array, delimiter);
-    while(token != NULL){
-        output[i] = strdup(token); // Copy the token to output
-        if (!output[i]) {
-            perror("strdup");
-            exit(EXIT_FAILURE);
-        }
-        i += 1;
-        token = strtok(NULL, delimiter); // Move to the next token
+    output[i++] = argv;
+    for(int k = 0; argv[k] != NULL; k++){
+        if(!IS_LIT(lit, k) && strcmp(argv[k], "|") == 0){
+            argv[k] = NULL;
+            output[i++] = &argv[k + 1];
+        }
     }
     return i;
 }
 
 /* pipe_eval - evaluates piped commands
  *
- *
- *
+ * Runs in the job's child process. Each stage is forked with its stdin
+ * and stdout wired to its neighbours, and then applies its own
+ * redirections (nredirs[k] of them in redirs[k]) on top. The child
+ * exits with the status of the last stage.
 */
-void pipe_eval(char **pipedarg, int pipenumber){
+void pipe_eval(char ***pipedarg, int pipenumber, struct redir_t **redirs, int *nredirs){
 
     int fd[2];
-    int standard_in = dup(STDIN_FILENO);
-    int standard_out = dup(STDOUT_FILENO);
+    // Close-on-exec, like the pipes, so no stage inherits a stray copy
+    int standard_in = fcntl(STDIN_FILENO, F_DUPFD_CLOEXEC, 0);
+    int standard_out = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+    pid_t pids[pipenumber];
+    int status, last = 0;
 
     for(int arg = 0; arg < pipenumber; arg++){
-        char *parsed_arg[MAXARGS];
-        int parsed_argc;
-        char * argv_no_redirc[MAXARGS];
-
-        int counter = 0;
+        char **argv_no_redirc = pipedarg[arg];
 
-        parsed_argc = parseline(pipedarg[arg], parsed_arg);
-        if(parsed_argc == 0){
+        if(argv_no_redirc[0] == NULL){
             printf("Incorrect Usage of pipe\n");
-            return;
-        }
-
-        for(int i = 0; i < parsed_argc; i++){
-            if(strcmp(parsed_arg[i], "<") == 0){
-                i ++;
-            }else if(strcmp(parsed_arg[i], ">") == 0){
-                i ++;
-            }else{
-                argv_no_redirc[counter] = parsed_arg[i];
-                counter ++;
-            }
+            exit(1);
         }
-        argv_no_redirc[counter] = NULL;
 
         // Setting up pipes
         // First file that is being piped
         
         if(arg == 0){
-            if(pipe(fd) == -1){perror("pipe"); exit(-1);}
+            if(pipe2(fd, O_CLOEXEC) == -1){perror("pipe"); exit(-1);}
             if(dup2(fd[1], STDOUT_FILENO) == -1) {
                 perror("dup2");
                 exit(-1);
@@ -228,11 +634,13 @@ void pipe_eval(char **pipedarg, int pipenumber){
         }
         else if (arg == pipenumber - 1){
             if(dup2(fd[0], STDIN_FILENO) == -1){perror("dup2"); exit(-1);}
+            close(fd[0]);
             if(dup2(standard_out,STDOUT_FILENO) == -1){perror("dup2"); exit(-1);}
         }
         else{
             if(dup2(fd[0], STDIN_FILENO) == -1){perror("dup2"); exit(-1);}
-            if(pipe(fd) == -1){perror("pipe"); exit(-1);}
+            close(fd[0]);
+            if(pipe2(fd, O_CLOEXEC) == -1){perror("pipe"); exit(-1);}
             if(dup2(fd[1], STDOUT_FILENO) == -1) {perror("dup2"); exit(-1);}
             close(fd[1]);
         }
@@ -242,6 +650,9 @@ void pipe_eval(char **pipedarg, int pipenumber){
         if(pid == -1){perror("fork");exit(-1);}
 
         if(pid == 0){ // In the child, exec
+            if (apply_redirs(redirs[arg], nredirs[arg]) == -1)
+                exit(1);
+            func_exit(argv_no_redirc);
             execv(argv_no_redirc[0], argv_no_redirc);
             printf("%s: Command not found\n", argv_no_redirc[0]);
             exit(1);
@@ -249,245 +660,670 @@ void pipe_eval(char **pipedarg, int pipenumber){
         else{ // In the parent
             dup2(standard_in, STDIN_FILENO);
             dup2(standard_out, STDOUT_FILENO);
-            // waitpid(pid, NULL, 0);
+            pids[arg] = pid;
         }   
     }
+    close(standard_in);
+    close(standard_out);
+    // Only wait for our stages: <(...) commands are our children too
     for (int k = 0; k < pipenumber; k++) {
-        waitpid(-1, NULL, WUNTRACED);
+        if (waitpid(pids[k], &status, WUNTRACED) > 0 && k == pipenumber - 1)
+            last = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
     }
-    exit(0);
+    exit(last);
 }
 
 
+/*
+ * heredoc_fd - Return a descriptor, positioned at the start, from which
+ *    the body of a here-document (or with newline set, a here-string
+ *    plus a newline) can be read. The body lives in a sealed memfd, so
+ *    there is no temp file on disk and no pipe that could fill up.
+ */
+int heredoc_fd(const char *body, int newline) {
+    size_t len = strlen(body);
+    ssize_t n;
+    int fd;
 
-/* 
+    if ((fd = memfd_create("tsh-heredoc", MFD_CLOEXEC | MFD_ALLOW_SEALING)) == -1)
+        return -1;
+    while (len > 0) {
+        if ((n = write(fd, body, len)) == -1) {
+            if (errno == EINTR)
+                continue;
+            close(fd);
+            return -1;
+        }
+        body += n;
+        len -= n;
+    }
+    if ((newline && write(fd, "\n", 1) != 1) ||
+        fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == -1 ||
+        lseek(fd, 0, SEEK_SET) == -1) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * procsub - Start the command of a <(...) (dir '<') or >(...) (dir '>')
+ *    for an argument, and return the "/dev/fd/N" path that names the
+ *    job's end of the pipe, which stays open across exec.
+ */
+char *procsub(const char *text, int dir) {
+    char path[32];
+
+    snprintf(path, sizeof(path), "/dev/fd/%d", procsub_fd(text, dir));
+    return strdup(path);
+}
+
+/*
+ * procsub_fd - Start the command of a <(...) or >(...) as a child of
+ *    the calling job process, connected to it by a pipe, and return the
+ *    job's end. Since the child stays in the job's process group, ctrl-c
+ *    and ctrl-z reach it along with the job.
+ */
+int procsub_fd(const char *text, int dir) {
+    struct node_t *list;
+    int fd[2];
+    int keep = dir == '<' ? 0 : 1; // the end the job reads or writes
+    int rc;
+    pid_t pid;
+
+    if (pipe(fd) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    if ((pid = fork()) == -1) {
+        perror("fork");
+        exit(1);
+    }
+    if (pid == 0) {
+        if (dup2(fd[1 - keep], keep ? STDIN_FILENO : STDOUT_FILENO) == -1) {
+            perror("dup2");
+            exit(1);
+        }
+        close(fd[0]);
+        close(fd[1]);
+        subshell = 1;
+        Signal(SIGINT, SIG_DFL);
+        Signal(SIGTSTP, SIG_DFL);
+        Signal(SIGCHLD, SIG_DFL);
+        last_status = 2;
+        if ((rc = parse_script(text, &list, NULL)) == P_OK)
+            exec_list(list);
+        else if (rc == P_INCOMPLETE)    /* stdout may be the pipe */
+            fprintf(stderr, "syntax error: unexpected end of file\n");
+        fflush(stdout);
+        exit(last_status);
+    }
+    close(fd[1 - keep]);
+    return fd[keep];
+}
+
+/*
  * eval - Evaluate the command line that the user has just typed in
+ *
+ * The line is parsed into a list of commands and if/for/while
+ * constructs, which is then executed. Returns nonzero if the line
+ * ends inside an open construct or quote, in which case nothing is
+ * run and the caller should append the next line and try again. If
+ * it ends inside a here-document, here says which.
+ */
+int eval(char *cmdline, struct heredoc_t *here) {
+    struct node_t *list;
+
+    switch (parse_script(cmdline, &list, here)) {
+        case P_INCOMPLETE:
+            return 1;
+        case P_OK:
+            exec_list(list);
+            free_nodes(list);
+            break;
+        default:
+            last_status = 2;
+    }
+    return 0;
+}
+
+/* 
+ * eval_cmd - Run a single command line that has already been split into
+ *    words.
  * 
  * If the user has requested a built-in command (quit, jobs, bg or fg)
- * then execute it immediately. Otherwise, fork a child process and
- * run the job in the context of the child. If the job is running in
+ * then execute it immediately, and likewise a shell function in the
+ * foreground with nothing around it. Otherwise, open the targets of any
+ * redirections, fork a child process and run the job in the context
+ * of the child. If the job is running in
  * the foreground, wait for it to terminate and then return.  Note:
  * each child process must have a unique process group ID so that our
  * background children don't receive SIGINT (SIGTSTP) from the kernel
  * when we type ctrl-c (ctrl-z) at the keyboard.  
 */
-void eval(char *cmdline) {
-    // Parsing the command line
-	char *argv[MAXARGS];
-    int argc;
-    argc = parseline(cmdline, argv);
-    // Check if its a builtin command, if so, send it to builtin_cmd
+void eval_cmd(char *cmdline, int argc, char **argv, const char *lit) {
+    struct redir_t *redirs, **stage_redirs;
+    const char *target, *outer_lit;
+    char **words, **args, ***stages, ***pipedarg, *procsub_dir;
+    int *procsubs, *opened, *nredirs;
+    int nargs = 0, nprocsubs = 0, nopened = 0;
+    int cork[2] = {-1, -1};
+    struct perf_t *perf = NULL;
+    struct def_t *func;
+    int bg, pipenumber, status, jid, plain = 1;
+    sigset_t set, oldset;
+    pid_t pid;
+
+    // Check if its a builtin command, if so, builtin_cmd runs it. One
+    // with redirections or in a pipeline is sorted out further down
     if (argc == 0){
         return;
     }
-    else if (strcmp(argv[0], "quit") == 0 || strcmp(argv[0], "jobs") == 0 || strcmp(argv[0], "fg") == 0 || strcmp(argv[0], "bg") == 0){
-	    builtin_cmd(argv);
+    if (is_builtin(argv[0])){
+        for (int i = 1; i < argc && plain; i++){
+            plain = IS_LIT(lit, i) ||
+                    (strcmp(argv[i], "|") != 0 && !redir_op(argv[i], NULL, NULL, NULL));
+        }
     }
-    else{
-        // Blocking signals with setmask
-        sigset_t set, oldset;
-        sigemptyset(&set);
-        sigfillset(&set);
-        sigprocmask(SIG_BLOCK, &set, &oldset);
-        // Checking for input output redirection (YET TO BE IMPLEMENTED)
-        // Checking if it runs in background or foreground
-        int fg = TRUE;
-        if(strcmp(argv[argc-1], "&") == 0){fg = FALSE;}
-            
+    outer_lit = argv_lit;
+    argv_lit = lit;
+    if (plain && builtin_cmd(argv)){
+        argv_lit = outer_lit;
+        return;
+    }
+    argv_lit = outer_lit;
+    bg = !IS_LIT(lit, argc - 1) && strcmp(argv[argc - 1], "&") == 0;
 
-        // Add to job list, deal with making sure that the child doesn't 
-        // send stop signal before the job is added. May have to write code 
-        // before the fork. Check hint 1
-        
-        int input_red = 0;
-        char* input_red_file;
-        int output_red = 0;
-        char* output_red_file;
+    // Sized by argc, since command lines have no fixed limit. &>f is
+    // two redirections in one word
+    words = malloc((argc + 1) * sizeof(char *));
+    args = malloc((argc + 2) * sizeof(char *));
+    procsubs = malloc(argc * sizeof(int));  // args slots that are <(...) or >(...)
+    procsub_dir = malloc(argc);
+    stages = malloc((argc + 1) * sizeof(char **));
+    pipedarg = malloc((argc + 1) * sizeof(char **));
+    redirs = malloc(2 * argc * sizeof(struct redir_t));
+    stage_redirs = malloc((argc + 1) * sizeof(struct redir_t *));
+    nredirs = malloc((argc + 1) * sizeof(int));
+    opened = malloc(2 * argc * sizeof(int));
+    if (!words || !args || !procsubs || !procsub_dir || !stages || !pipedarg ||
+        !redirs || !stage_redirs || !nredirs || !opened){
+        unix_error("malloc error");
+    }
 
-        char * argv_no_redirc[MAXARGS];
-        int counter = 0;
+    // Split the words into pipeline stages, and each stage into its
+    // arguments and its own redirections, opening every redirection
+    // target now so a bad one costs no process
+    memcpy(words, argv, (argc - bg) * sizeof(char *));
+    words[argc - bg] = NULL;
+    pipenumber = pipe_tokenizer(words, lit, stages);
+    for (int s = 0; s < pipenumber; s++){
+        char **sv = stages[s];
+        int first = sv - words, n = 0;
+        const char *slit = lit ? lit + first : NULL;
 
-        // Fork Process
-        int pid = fork();
-        
-        for(int i = 0; i < argc; i++){
-            if(strcmp(argv[i], "<") == 0){
-                input_red = 1;
-                input_red_file = argv[i+1];
-                // printf("Input redirect required into: %s\n",input_red_file);
-                i ++;
-            }else if(strcmp(argv[i], ">") == 0){
-                output_red = 1;
-                output_red_file = argv[i+1];
-                // printf("Output redirect required into: %s\n",output_red_file);
-                i++;
-            }else{
-                argv_no_redirc[counter] = argv[i];
-                counter ++;
-            }
-        }
-        argv_no_redirc[counter] = NULL;
-        
-        char *pipedarg[MAXARGS];
-        int pipenumber = pipe_tokenizer(cmdline, pipedarg);
-        
-        // Run in foreground
-        if (fg) {
-            // Child setting its own process group
-            if (pid == 0) {
-                Signal(SIGINT, SIG_IGN);
-                Signal(SIGTSTP, SIG_IGN);
-                Signal(SIGCHLD, SIG_IGN);
-
-                setpgid(0,0);
-                if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1){
-                    perror("sigprocmask() error");
-                }
-                if(input_red){
-                    int input_file = open(input_red_file, O_RDONLY);
-                    if(input_file == -1){
-                        perror("open");
-                    }
-                    if(dup2(input_file ,fileno(stdin)) == -1){
-                        perror("Error redirecting stdin");
-                        exit(EXIT_FAILURE);
-                    }
-                }   
-                if(output_red){
-                    int output_file = open(output_red_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if(output_file == -1){
-                        perror("File open error");
-                    }
-                    if (dup2( output_file, fileno(stdout)) == -1){
-                        perror("Error redirecting stdout");
-                        exit(EXIT_FAILURE);
+        while (sv[n]){
+            n++;
+        }
+        pipedarg[s] = &args[nargs];
+        for (int i = 0; i < n; i++){
+            if (IS_LIT(slit, i)){
+                args[nargs++] = sv[i];
+            }
+            else if ((strcmp(sv[i], "<(") == 0 || strcmp(sv[i], ">(") == 0) && sv[i + 1]){
+                // The child swaps the text for a /dev/fd path
+                procsub_dir[nprocsubs] = sv[i][0];
+                procsubs[nprocsubs++] = nargs;
+                args[nargs++] = sv[++i];
+            }
+            else if (redir_op(sv[i], NULL, NULL, &target)){
+                if (!*target && i + 1 < n){ // the target is the next word
+                    i++;
+                    if (!IS_LIT(slit, i) && (strcmp(sv[i], "<(") == 0 || strcmp(sv[i], ">(") == 0) &&
+                        sv[i + 1]){
+                        i++;
                     }
                 }
-                // Checking if we need to pipe
-                if(pipenumber > 1){
-                    Signal(SIGINT, SIG_DFL);
-                    Signal(SIGTSTP, SIG_DFL);
-                    Signal(SIGCHLD, SIG_DFL);
-                    pipe_eval(pipedarg, pipenumber);
-                }
-                // We don't need to pipe
-                else{
-                    Signal(SIGINT, SIG_DFL);
-                    Signal(SIGTSTP, SIG_DFL);
-                    Signal(SIGCHLD, SIG_DFL);
-                    execv(argv[0], argv_no_redirc);
-                    printf("%s: Command not found\n", argv[0]);
-                    exit(1);
-                }
-            } 
-            // Parent setting child's process group and adding to the job
+            }
             else {
-                setpgid(pid, pid);
-                addjob(jobs, pid, FG, cmdline);
-                if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1){
-                    perror("sigprocmask() error");
-                }
-                waitfg(pid);
+                args[nargs++] = sv[i];
             }
-            
         }
-        // Run in background
-        else{
-            if (pid == 0) {
-                Signal(SIGINT, SIG_IGN);
-                Signal(SIGTSTP, SIG_IGN);
-                Signal(SIGCHLD, SIG_IGN);   
-                argv[argc - 1] = '\0';
-                
-                if(input_red){
-                    argv_no_redirc[counter-1] = '\0';
-                }
-                else if(output_red){
-                    argv_no_redirc[counter-1] = '\0';
+        args[nargs++] = NULL;
 
-                }else if(input_red && output_red){
-                    argv_no_redirc[counter-1] = '\0';
-                }else{
-                    argv_no_redirc[counter - 1] = '\0';
+        stage_redirs[s] = &redirs[2 * first];
+        nredirs[s] = prepare_redirs(sv, slit, n, stage_redirs[s], opened, &nopened);
+        if (nredirs[s] == -1){
+            while (nopened--){
+                close(opened[nopened]);
+            }
+            last_status = 1;
+            goto done;
+        }
+    }
 
-                }
+    // A function runs right here, unless it needs a process of its own
+    // for &, a pipe, redirections, timeout or perfstat
+    if (!bg && pipenumber == 1 && nredirs[0] == 0 && nprocsubs == 0 &&
+        !launch_deadline && !launch_perf && args[0] &&
+        (func = getdef(functab, args[0])) != NULL){
+        call_func(func, nargs - 1, args);
+        goto done;
+    }
 
-                setpgid(0,0);
-                if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1){
-                    perror("sigprocmask() error");
-                }
-                if(input_red){
-                    int input_file = open(input_red_file, O_RDONLY);
-                    if(input_file == -1){
-                        perror("open");
-                    }
-                    dup2(input_file ,fileno(stdin));
-                }   
-                if(output_red){
-                    int output_file = open(output_red_file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-                    if(output_file == -1){
-                        perror("open");
-                    }
-                    if (dup2( output_file, fileno(stdout)) == -1){
-                        perror("Error redirecting stdout");
-                        exit(EXIT_FAILURE);
-                    }
-                    // printf("Output redirect\n");
-                }
-                // Checking if we need to pipe
-                if(pipenumber > 1){
-                    Signal(SIGINT, SIG_DFL);
-                    Signal(SIGTSTP, SIG_DFL);
-                    Signal(SIGCHLD, SIG_DFL);
-                    int length_of_last = strlen(pipedarg[pipenumber-1]);
-                    pipedarg[pipenumber-1][length_of_last-1] = '\0';
-                    pipe_eval(pipedarg, pipenumber);
-                }
-                // We don't need to pipe
-                else{
-                    Signal(SIGINT, sigint_handler);
-                    Signal(SIGTSTP, sigtstp_handler);
-                    Signal(SIGCHLD, sigchld_handler);
-                    execv(argv[0], argv_no_redirc);
-                    printf("%s: Command not found\n", argv[0]);
-                    exit(1);
-                }
-            }else{
-                setpgid(pid, pid);
-                addjob(jobs, pid, BG, cmdline);
-                int jid = getjobpid(jobs, pid)->jid;
-
-                //Printing the jid, pid, and argv
-                printf("[%d] (%d)", jid, pid);
-                for(int i = 0; i<argc; i++){
-                    printf(" %s", argv[i]);
-                }
-                printf("\n");
-                
-                if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1){
-                    perror("sigprocmask() error");
+    // So does a builtin with only redirections, which it needs for the
+    // while. Like a function, it gets a process of its own for the rest
+    if (!bg && pipenumber == 1 && nprocsubs == 0 && !launch_deadline && !launch_perf &&
+        args[0] && is_builtin(args[0])){
+        int k = 0;
+        while (k < nredirs[0] && !redirs[k].proc){
+            k++;
+        }
+        if (k == nredirs[0]){
+            redir_builtin(args, redirs, nredirs[0]);
+            while (nopened--){
+                close(opened[nopened]);
+            }
+            goto done;
+        }
+    }
+
+    // perfstat: the child waits on this pipe until its counters are
+    // attached, so they see it from the start
+    if (launch_perf){
+        launch_perf = 0;
+        if (pipe2(cork, O_CLOEXEC) == -1){
+            perror("perfstat: pipe");
+        }
+    }
+
+    // Block everything until the job is on the job list. Flush first so
+    // the child doesn't inherit (and later repeat) buffered output
+    sigfillset(&set);
+    sigprocmask(SIG_BLOCK, &set, &oldset);
+    fflush(stdout);
+    if ((pid = fork()) == -1){
+        unix_error("fork error");
+    }
+
+    if (pid == 0){
+        // Each job gets its own process group, so ctrl-c and ctrl-z
+        // only reach the shell, which passes them to the fg job
+        if (!subshell){
+            setpgid(0, 0);
+        }
+        Signal(SIGINT, SIG_DFL);
+        Signal(SIGTSTP, SIG_DFL);
+        Signal(SIGCHLD, SIG_DFL);
+        sigemptyset(&set); // timers may have launched us with SIGCHLD blocked
+        sigprocmask(SIG_SETMASK, &set, NULL);
+        if (nofile_raised){ // not jstat's raised limit
+            setrlimit(RLIMIT_NOFILE, &nofile_limit);
+        }
+        if (cork[0] != -1){
+            char c;
+            close(cork[1]);
+            while (read(cork[0], &c, 1) == -1 && errno == EINTR)
+                ;
+            close(cork[0]);
+        }
+
+        // Process substitutions run as our children, in our group
+        for (int k = 0; k < nprocsubs; k++){
+            args[procsubs[k]] = procsub(args[procsubs[k]], procsub_dir[k]);
+        }
+        if (pipenumber > 1){
+            pipe_eval(pipedarg, pipenumber, stage_redirs, nredirs);
+        }
+        if (apply_redirs(stage_redirs[0], nredirs[0]) == -1){
+            exit(1);
+        }
+        if (args[0] == NULL){   // nothing but redirections
+            exit(0);
+        }
+        func_exit(args);
+        execv(args[0], args);
+        printf("%s: Command not found\n", args[0]);
+        exit(1);
+    }
+
+    // The child has its own copies of the redirection targets
+    while (nopened--){
+        close(opened[nopened]);
+    }
+
+    if (cork[0] != -1){
+        perf = perf_new(0, cmdline);  // jid set once it has one
+        if (perf_attach(perf, pid) == -1){
+            printf("perfstat: perf_event_open: %s\n", strerror(errno));
+            perf_free(perf);
+            perf = NULL;
+        }
+        close(cork[0]);     // let the child go
+        close(cork[1]);
+    }
+
+    if (subshell){
+        // No job control inside <(...) or $(...): just wait for it
+        sigprocmask(SIG_SETMASK, &oldset, NULL);
+        last_status = 0;
+        if (!bg){
+            while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+                ;
+            last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            if (perf){
+                perf_print(perf);
+            }
+        }
+        if (perf){
+            perf_free(perf);
+        }
+        goto done;
+    }
+
+    setpgid(pid, pid);
+    if (bg && launch_into){     // a scheduled or pending job starts
+        jid = launch_into->jid;
+        launch_into->pid = pid;
+        launch_into->state = BG;
+        set_cmdline(launch_into, cmdline);
+        launch_into = NULL;
+    }
+    else {
+        jid = addjob(jobs, pid, bg ? BG : FG, cmdline);
+    }
+    if (perf){
+        perf->jid = jid;
+        getjobjid(jobs, jid)->perf = perf;
+    }
+    arm_deadline(pid);
+    if (bg){
+        //Printing the jid, pid, and argv; a quoted "&" ending the
+        //command already ends the line with one
+        notify("[%d] (%d)", jid, pid);
+        for (int i = 0; i < argc - 1; i++){
+            notify(" %s", argv[i]);
+        }
+        notify(argc > 1 && strcmp(argv[argc - 2], "&") == 0 ? "\n" : " &\n");
+        last_status = 0;
+    }
+    if (sigprocmask(SIG_SETMASK, &oldset, NULL) == -1){
+        perror("sigprocmask() error");
+    }
+    if (!bg){
+        waitfg(pid);
+        last_status = fg_status;
+        if (perf_done){
+            report_perf();
+        }
+    }
+
+done:
+    free(words);
+    free(args);
+    free(procsubs);
+    free(procsub_dir);
+    free(stages);
+    free(pipedarg);
+    free(redirs);
+    free(stage_redirs);
+    free(nredirs);
+    free(opened);
+}
+
+/*
+ * redir_op - Is word a redirection operator, possibly with an fd number
+ *    in front and its target attached? If so set *fd to the fd (-1 for
+ *    the operator's default, -2 for &> and &>>), *op to the operator and
+ *    *target to whatever follows it in the word. Any of them may be NULL.
+ */
+int redir_op(const char *word, int *fd, const char **op, const char **target) {
+    static const char *ops[] = {
+        "&>>", "&>", "<<<", "<<", ">>", ">&", "<&", "<", ">", NULL
+    };
+    const char *p = word;
+    const char **o;
+    int n = -1;
+
+    if (strcmp(word, "<(") == 0 || strcmp(word, ">(") == 0)
+        return 0;
+    if (isdigit((unsigned char)*p)) {
+        for (n = 0; isdigit((unsigned char)*p) && n < 100000; p++)
+            n = n * 10 + (*p - '0');
+        if (*p != '<' && *p != '>')
+            return 0;
+    }
+    for (o = ops; *o; o++)
+        if (strncmp(p, *o, strlen(*o)) == 0)
+            break;
+    if (!*o || (n != -1 && **o == '&'))
+        return 0;
+    if (fd)
+        *fd = **o == '&' ? -2 : n;
+    if (op)
+        *op = *o;
+    if (target)
+        *target = p + strlen(*o);
+    return 1;
+}
+
+/* set_redir - Make r the action for its fd, replacing any earlier one */
+static int set_redir(struct redir_t *redirs, int n, struct redir_t *r) {
+    int k;
+
+    for (k = 0; k < n && redirs[k].fd != r->fd; k++)
+        ;
+    redirs[k] = *r;
+    return k == n ? n + 1 : n;
+}
+
+/*
+ * prepare_redirs - Work out, left to right, where the redirections in
+ *    argv[0..argc) leave each fd of the child, opening files and
+ *    here-documents as it goes. Everything opened is O_CLOEXEC and is
+ *    listed in opened for the parent to close. The result has one action
+ *    per fd. Returns the number of actions, or -1 after saying why a
+ *    redirection can't be done.
+ */
+int prepare_redirs(char **argv, const char *lit, int argc,
+                   struct redir_t *redirs, int *opened, int *nopened) {
+    const char *op, *target;
+    struct redir_t r;
+    int i, k, n = 0, fd, flags, src, proc;
+
+    for (i = 0; i < argc; i++) {
+        if (IS_LIT(lit, i))
+            continue;
+        if (strcmp(argv[i], "<(") == 0 || strcmp(argv[i], ">(") == 0) {
+            i++;                        /* an argument, not a target */
+            continue;
+        }
+        if (!redir_op(argv[i], &fd, &op, &target))
+            continue;
+        proc = 0;
+        if (!*target) {
+            if (i + 1 >= argc) {
+                printf("syntax error near unexpected token `newline'\n");
+                return -1;
+            }
+            target = argv[++i];
+            proc = !IS_LIT(lit, i);
+        }
+        if (fd == -1)
+            fd = op[0] == '<' ? 0 : 1;
+        r.fd = fd;
+        r.src = -1;
+        r.proc = NULL;
+        r.dir = 0;
+
+        if (strcmp(op, ">&") == 0 || strcmp(op, "<&") == 0) {
+            if (strcmp(target, "-") == 0) {
+                n = set_redir(redirs, n, &r);
+                continue;
+            }
+            if (isdigit((unsigned char)*target)) {
+                src = atoi(target);
+                for (k = 0; k < n && redirs[k].fd != src; k++)
+                    ;
+                if (k < n)              /* already redirected: share it */
+                    r = redirs[k];
+                else if ((flags = fcntl(src, F_GETFD)) != -1 && !(flags & FD_CLOEXEC))
+                    r.src = src;        /* not one of the shell's own */
+                if (r.src == -1 && !r.proc) {
+                    printf("%s: Bad file descriptor\n", target);
+                    return -1;
                 }
+                r.fd = fd;
+                n = set_redir(redirs, n, &r);
+                continue;
+            }
+            if (strcmp(op, "<&") == 0 || fd != 1) {
+                printf("%s: ambiguous redirect\n", target);
+                return -1;
             }
+            op = "&>";                  /* >&file is the same as &>file */
+            fd = -2;
+        }
 
+        if (proc && (strcmp(target, "<(") == 0 || strcmp(target, ">(") == 0) && i + 1 < argc) {
+            r.proc = argv[++i];         /* started by the child */
+            r.dir = target[0];
         }
-            
+        else if (op[1] == '<') {        /* << and <<< */
+            if ((r.src = heredoc_fd(target, op[2] == '<')) == -1) {
+                printf("here-document: %s\n", strerror(errno));
+                return -1;
+            }
+            opened[(*nopened)++] = r.src;
+        }
+        else {
+            flags = op[0] == '<' ? O_RDONLY :
+                    O_WRONLY | O_CREAT | (strstr(op, ">>") ? O_APPEND : O_TRUNC);
+            if ((r.src = open(target, flags | O_CLOEXEC, 0644)) == -1) {
+                printf("%s: %s\n", target, strerror(errno));
+                return -1;
+            }
+            opened[(*nopened)++] = r.src;
+        }
+        if (fd == -2) {                 /* &> and &>> */
+            r.fd = 1;
+            n = set_redir(redirs, n, &r);
+            r.fd = 2;
+        }
+        n = set_redir(redirs, n, &r);
     }
 
+    return n;
+}
+
+/*
+ * apply_redirs - In the child, carry out the actions prepare_redirs
+ *    worked out: one dup2 or close per fd. The sources are close-on-exec
+ *    and go away by themselves. <(...) and >(...) targets are started
+ *    here, so they land in the job's process group. A source that is
+ *    also a target (2>&1 >f) is copied out of the way first; that has
+ *    to happen here, after a pipeline stage's stdin and stdout are in
+ *    place, so 2>&1 means the pipe. Returns 0, or -1 after saying what
+ *    went wrong.
+ */
+int apply_redirs(struct redir_t *redirs, int n) {
+    int i, j, k, fd, src, maxfd = 2, moved[n + 1], nmoved = 0, ret = -1;
+
+    for (i = 0; i < n; i++)
+        if (redirs[i].fd > maxfd)
+            maxfd = redirs[i].fd;
+    for (i = 0; i < n; i++) {
+        if (!redirs[i].proc)
+            continue;
+        for (j = 0; j < i && redirs[j].proc != redirs[i].proc; j++)
+            ;
+        if (j < i) {                    /* 2>&1 after > >(...) */
+            redirs[i].src = redirs[j].src;
+            continue;
+        }
+        fd = procsub_fd(redirs[i].proc, redirs[i].dir);
+        redirs[i].src = fcntl(fd, F_DUPFD_CLOEXEC, maxfd + 1);
+        close(fd);
+    }
+    for (k = 0; k < n; k++) {
+        src = redirs[k].src;
+        if (redirs[k].proc || src < 0)
+            continue;
+        for (i = 0; i < n && redirs[i].fd != src; i++)
+            ;
+        if (i == n)
+            continue;
+        if ((fd = fcntl(src, F_DUPFD_CLOEXEC, maxfd + 1)) == -1) {
+            perror("dup");
+            goto out;
+        }
+        moved[nmoved++] = fd;
+        for (i = k; i < n; i++)
+            if (!redirs[i].proc && redirs[i].src == src)
+                redirs[i].src = fd;
+    }
+    for (i = 0; i < n; i++) {
+        if (redirs[i].src == -1)
+            close(redirs[i].fd);
+        else if (dup2(redirs[i].src, redirs[i].fd) == -1) {
+            perror("dup2");
+            goto out;
+        }
+    }
+    ret = 0;
+out:
+    while (nmoved--)
+        close(moved[nmoved]);
+    return ret;
+}
+
+/*
+ * redir_builtin - Run the builtin argv right here in the shell, with
+ *    the redirections applied to the shell's own fds until it is done.
+ *    None may be a <(...) or >(...), which would start in the shell.
+ */
+void redir_builtin(char **argv, struct redir_t *redirs, int n) {
+    int k, maxfd = 2, saved[n + 1];
+
+    for (k = 0; k < n; k++)
+        if (redirs[k].fd > maxfd)
+            maxfd = redirs[k].fd;
+    fflush(stdout);
+    for (k = 0; k < n; k++)             /* -1 if it wasn't open */
+        saved[k] = fcntl(redirs[k].fd, F_DUPFD_CLOEXEC, maxfd + 1);
+    if (apply_redirs(redirs, n) == 0)
+        builtin_cmd(argv);
+    else
+        last_status = 1;
+    fflush(stdout);
+    for (k = 0; k < n; k++) {
+        if (saved[k] == -1) {
+            close(redirs[k].fd);
+        }
+        else {
+            dup2(saved[k], redirs[k].fd);
+            close(saved[k]);
+        }
+    }
 }
 
 /* 
  * parseline - Parse the command line and build the argv array.
  * 
  * Characters enclosed in single quotes are treated as a single
- * argument.  Return number of arguments parsed.
+ * argument.  Return number of arguments parsed. The shell itself uses
+ * the script parser now; this is the plain strchr tokenizer it grew
+ * out of, kept as a reference. argv must have room for every word.
  */
 int parseline(const char *cmdline, char **argv) {
-    static char array[MAXLINE]; /* holds local copy of command line */
-    char *buf = array;          /* ptr that traverses command line */
+    static struct strbuf_t array; /* holds local copy of command line */
+    char *buf;                  /* ptr that traverses command line */
     char *delim;                /* points to space or quote delimiters */
     int argc;                   /* number of args */
 
-    strcpy(buf, cmdline);
+    array.len = 0;
+    sb_puts(&array, cmdline);
+    buf = array.s;
     buf[strlen(buf)-1] = ' ';  /* replace trailing '\n' with space */
     while (*buf && (*buf == ' ')) /* ignore leading spaces */
         buf++;
@@ -522,377 +1358,4030 @@ int parseline(const char *cmdline, char **argv) {
     return argc;
 }
 
-/* 
- * builtin_cmd - If the user has typed a built-in command then execute
- *    it immediately.  
+/**********************************
+ * Script parsing and control flow
+ **********************************/
+
+struct token_t {            /* One token of lookahead for the parser */
+    int type;               /* T_EOF, T_WORD or T_SEP */
+    char *word;             /* T_WORD: malloc'd, quotes removed */
+    int quoted;             /* had quotes, so it is never a keyword */
+    int lit;                /* partly quoted or with a $: never an operator */
+    int expand;             /* contains a '$' */
+    int procsub;            /* '<' or '>' for <(...) and >(...) */
+    const char *start;      /* source span of the token */
+    const char *end;
+};
+
+struct parser_t {
+    const char *p;          /* next unread character */
+    const char *body;       /* where the next here-document body starts */
+    struct token_t tok;     /* lookahead token */
+    int have_tok;           /* tok is valid */
+    int status;             /* P_OK, P_INCOMPLETE or P_ERROR */
+    struct heredoc_t here;  /* the here-document the text ends inside */
+};
+
+static const char *reserved[] = {
+    "if", "then", "elif", "else", "fi", "for", "do", "done", "while", "}", NULL
+};
+
+static struct node_t *parse_list(struct parser_t *ps, const char **stop);
+static unsigned varhash(const char *name);
+
+/*
+ * delim_span_scalar - Length of the initial part of str free of the
+ *    characters in set. The one-character-at-a-time reference for
+ *    delim_span; build with -DTSH_SCALAR_SCAN to use it throughout.
  */
-int builtin_cmd(char **argv) {
-    // Check if its quit, fg, bg, or jobs
+size_t delim_span_scalar(const char *str, const char *set) {
+    const char *p = str;
+
+    while (*p && !strchr(set, *p))
+        p++;
+    return p - str;
+}
+
+/*
+ * delim_span - Same as delim_span_scalar, but compares a whole vector
+ *    of characters against every delimiter (and NUL) at once, so long
+ *    words and multi-megabyte lines are scanned at memory speed. Loads
+ *    are aligned, so they never cross into a page past the string's
+ *    end. set may hold at most 16 characters.
+ */
+size_t delim_span(const char *str, const char *set) {
+#if defined(__AVX2__) && !defined(TSH_SCALAR_SCAN)
+    const char *p = (const char *)((uintptr_t)str & ~(uintptr_t)31);
+    __m256i want[16], v, hit;
+    uint32_t mask = ~0u << (str - p);
+    int n, i;
+
+    for (n = 0; set[n]; n++)
+        want[n] = _mm256_set1_epi8(set[n]);
+    while (1) {
+        v = _mm256_load_si256((const __m256i *)p);
+        hit = _mm256_cmpeq_epi8(v, _mm256_setzero_si256());
+        for (i = 0; i < n; i++)
+            hit = _mm256_or_si256(hit, _mm256_cmpeq_epi8(v, want[i]));
+        mask &= (uint32_t)_mm256_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask) - str;
+        p += 32;
+        mask = ~0u;
+    }
+#elif defined(__SSE2__) && !defined(TSH_SCALAR_SCAN)
+    const char *p = (const char *)((uintptr_t)str & ~(uintptr_t)15);
+    __m128i want[16], v, hit;
+    unsigned mask = 0xffffu << (str - p);
+    int n, i;
+
+    for (n = 0; set[n]; n++)
+        want[n] = _mm_set1_epi8(set[n]);
+    while (1) {
+        v = _mm_load_si128((const __m128i *)p);
+        hit = _mm_cmpeq_epi8(v, _mm_setzero_si128());
+        for (i = 0; i < n; i++)
+            hit = _mm_or_si128(hit, _mm_cmpeq_epi8(v, want[i]));
+        mask &= (unsigned)_mm_movemask_epi8(hit);
+        if (mask)
+            return p + __builtin_ctz(mask) - str;
+        p += 16;
+        mask = 0xffffu;
+    }
+#else
+    return delim_span_scalar(str, set);
+#endif
+}
+
+/*
+ * subst_end - Find the ')' that closes a $(, <( or >( whose text starts
+ *    at p, skipping quoted parts and nested parentheses. Returns NULL if
+ *    the text ends first.
+ */
+const char *subst_end(const char *p) {
+    int depth = 1;
+    char q;
+
+    for (; *p; p++) {
+        if (*p == '\'' || *p == '"') {
+            q = *p++;
+            while (*p && *p != q)
+                p++;
+            if (!*p)
+                return NULL;
+        }
+        else if (*p == '(') {
+            depth++;
+        }
+        else if (*p == ')' && --depth == 0) {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+/*
+ * lex_subst - Copy the $(...) at p into sb as it is; the text inside is
+ *    parsed when it first runs. Returns where the word continues.
+ */
+static const char *lex_subst(struct parser_t *ps, struct strbuf_t *sb, const char *p) {
+    const char *end = subst_end(p + 2);
+
+    if (!end) {                         /* continues on the next line */
+        ps->status = P_INCOMPLETE;
+        end = p + strlen(p) - 1;
+    }
+    sb_putn(sb, p, end + 1 - p);
+    return end + 1;
+}
+
+/*
+ * redir_len - Length of the redirection operator at p, with any fd
+ *    number in front, or 0 if there isn't one
+ */
+static size_t redir_len(const char *p) {
+    size_t n = strspn(p, "0123456789");
+
+    if (n == 0 && p[0] == '&' && p[1] == '>')
+        return p[2] == '>' ? 3 : 2;                     /* &> and &>> */
+    if (p[n] == '<' && p[n + 1] == '<')                 /* <<, <<- and <<< */
+        return n + 2 + (p[n + 2] == '-' || p[n + 2] == '<');
+    if (p[n] == '<')                                    /* < and <& */
+        return n + 1 + (p[n + 1] == '&');
+    if (p[n] == '>')                                    /* >, >> and >& */
+        return n + 1 + (p[n + 1] == '>' || p[n + 1] == '&');
+    return 0;
+}
+
+/*
+ * lex - Read the next token. Words are split on blanks, ';', newline,
+ *    '|', '&', '<' and '>'. '|', '&' and redirection operators (with
+ *    any fd number in front, as in 2>&) are returned as words of their
+ *    own, so cmd>out is three words. <(...) and >(...) are returned
+ *    whole, and so is a $(...) inside a word. Single and double quotes
+ *    group characters into one word.
+ */
+static void lex(struct parser_t *ps, struct token_t *t) {
+    const char *p = ps->p;
+    struct strbuf_t sb = {0};
+    size_t n;
+    char q;
+
+    while (*p == ' ' || *p == '\t')
+        p++;
+    if (*p == '#')                      /* comment runs to end of line */
+        while (*p && *p != '\n')
+            p++;
+
+    t->start = p;
+    t->word = NULL;
+    t->quoted = t->expand = t->procsub = t->lit = 0;
+    if (*p == '\0') {
+        t->type = T_EOF;
+    }
+    else if (*p == ';' || *p == '\n') {
+        t->type = T_SEP;
+        if (*p++ == '\n' && ps->body) { /* hop over here-document bodies */
+            p = ps->body;
+            ps->body = NULL;
+        }
+    }
+    else if ((p[0] == '<' || p[0] == '>') && p[1] == '(') {
+        /* <(...) or >(...): the word is the text up to the matching ')' */
+        const char *end = subst_end(p + 2);
+
+        t->type = T_WORD;
+        t->procsub = *p;
+        p += 2;
+        if (!end) {
+            end = p + strlen(p);
+            ps->status = P_INCOMPLETE;
+        }
+        sb_putn(&sb, p, end - p);
+        p = *end ? end + 1 : end;
+        t->word = sb_finish(&sb);
+    }
+    else if ((n = redir_len(p)) > 0) {
+        t->type = T_WORD;
+        sb_putn(&sb, p, n);
+        p += n;
+        t->word = sb_finish(&sb);
+    }
+    else if (*p == '|' || *p == '&') {
+        t->type = T_WORD;
+        sb_putc(&sb, *p++);
+        t->word = sb_finish(&sb);
+    }
+    else {
+        /* Copy whole runs of ordinary characters at a time */
+        t->type = T_WORD;
+        while (1) {
+            n = delim_span(p, " \t\n;|&<>'\"$");
+            sb_putn(&sb, p, n);
+            p += n;
+            if (*p == '$') {
+                t->expand = 1;
+                if (p[1] == '(')
+                    p = lex_subst(ps, &sb, p);
+                else
+                    sb_putc(&sb, *p++);
+                continue;
+            }
+            if (*p != '\'' && *p != '"')
+                break;
+            q = *p++;
+            t->quoted = 1;
+            while (1) {
+                n = delim_span(p, q == '\'' ? "'$" : "\"$");
+                sb_putn(&sb, p, n);
+                p += n;
+                if (*p != '$')
+                    break;
+                t->expand = 1;
+                if (q == '"' && p[1] == '(') {
+                    sb_putc(&sb, SUBST_DQ);
+                    p = lex_subst(ps, &sb, p);
+                    continue;
+                }
+                if (q == '"' && (p[1] == '@' || p[1] == '*'))
+                    sb_putc(&sb, SUBST_DQ);
+                if (q == '\'')
+                    sb_putc(&sb, QUOTE_ESC);
+                sb_putc(&sb, *p++);
+            }
+            if (*p == '\0') {           /* quote continues on the next line */
+                ps->status = P_INCOMPLETE;
+                break;
+            }
+            p++;
+        }
+        t->lit = t->quoted || t->expand;
+        t->word = sb_finish(&sb);
+    }
+    t->end = p;
+    ps->p = p;
+}
+
+/* peek - Return the lookahead token, reading it if needed */
+static struct token_t *peek(struct parser_t *ps) {
+    if (!ps->have_tok) {
+        lex(ps, &ps->tok);
+        ps->have_tok = 1;
+    }
+    return &ps->tok;
+}
+
+/* consume - Drop the lookahead token; the caller owns its word */
+static void consume(struct parser_t *ps) {
+    ps->have_tok = 0;
+}
+
+/* skip - Drop the lookahead token and free its word */
+static void skip(struct parser_t *ps) {
+    free(peek(ps)->word);
+    consume(ps);
+}
+
+/* in_list - Is t an unquoted word found in the NULL terminated list? */
+static int in_list(struct token_t *t, const char **list) {
+    if (t->type != T_WORD || t->quoted || !list)
+        return 0;
+    for (; *list; list++)
+        if (strcmp(t->word, *list) == 0)
+            return 1;
+    return 0;
+}
+
+static int keyword(struct token_t *t, const char *kw) {
+    return t->type == T_WORD && !t->quoted && strcmp(t->word, kw) == 0;
+}
+
+static void syntax_error(struct parser_t *ps, struct token_t *t) {
+    if (ps->status != P_OK)
+        return;
+    printf("syntax error near unexpected token `%s'\n",
+           t->type == T_WORD ? t->word : "newline");
+    ps->status = P_ERROR;
+}
+
+/* expect - Consume keyword kw or flag a syntax error */
+static int expect(struct parser_t *ps, const char *kw) {
+    struct token_t *t = peek(ps);
+
+    if (ps->status != P_OK)
+        return 0;
+    if (!keyword(t, kw)) {
+        syntax_error(ps, t);
+        return 0;
+    }
+    skip(ps);
+    return 1;
+}
+
+static struct node_t *new_node(int type) {
+    struct node_t *n = calloc(1, sizeof(struct node_t));
+
+    if (!n)
+        unix_error("calloc error");
+    n->type = type;
+    return n;
+}
+
+/*
+ * add_word - Append a word to a command, keeping argv NULL terminated.
+ *    It counts as an operator candidate (lit 0) until the caller says.
+ */
+static void add_word(struct cmd_t *cmd, char *word, int expand) {
+    if (cmd->argc + 2 > cmd->cap) {
+        cmd->cap = cmd->cap ? 2 * cmd->cap : 8;
+        if ((cmd->argv = realloc(cmd->argv, cmd->cap * sizeof(char *))) == NULL ||
+            (cmd->lit = realloc(cmd->lit, cmd->cap)) == NULL)
+            unix_error("realloc error");
+    }
+    cmd->lit[cmd->argc] = 0;
+    cmd->argv[cmd->argc++] = word;
+    cmd->argv[cmd->argc] = NULL;
+    cmd->expand |= expand;
+}
+
+/*
+ * heredoc_end - Is line (up to its newline) the terminator delim? With
+ *    strip (<<-) leading tabs are ignored.
+ */
+int heredoc_end(const char *line, const char *delim, int strip) {
+    size_t n = strlen(delim);
+
+    if (strip)
+        while (*line == '\t')
+            line++;
+    return strncmp(line, delim, n) == 0 &&
+           (line[n] == '\n' || line[n] == '\0');
+}
+
+/*
+ * read_heredoc - Collect the body of a here-document ending at delim.
+ *    Bodies start on the line after the current one and follow each
+ *    other in order; the lexer skips them when it reaches that newline.
+ *    A quoted delim means the body is taken literally: its '$'s are
+ *    marked, and like a single quoted word it still goes through
+ *    expand, which drops the marks.
+ */
+static char *read_heredoc(struct parser_t *ps, struct token_t *delim,
+                          int strip, int *expand) {
+    struct strbuf_t sb = {0};
+    const char *line = ps->body, *nl, *next;
+
+    if (!line) {
+        line = strchr(ps->p, '\n');
+        line = line ? line + 1 : NULL;
+    }
+    *expand = !delim->quoted;
+    while (line && *line) {
+        nl = strchr(line, '\n');
+        if (heredoc_end(line, delim->word, strip)) {
+            ps->body = nl ? nl + 1 : line + strlen(line);
+            return sb_finish(&sb);
+        }
+        if (!nl)                        /* rest of the line is still to come */
+            break;
+        next = nl + 1;
+        if (strip)
+            while (*line == '\t')
+                line++;
+        for (; line < next; line++) {
+            if (*line == '$' && delim->quoted) {
+                sb_putc(&sb, QUOTE_ESC);
+                *expand = 1;
+            }
+            sb_putc(&sb, *line);
+        }
+    }
+
+    /* Not terminated yet: main reads on until the delimiter shows up */
+    if (ps->status == P_OK) {
+        ps->status = P_INCOMPLETE;
+        ps->here.delim = strdup(delim->word);
+        ps->here.strip = strip;
+    }
+    return sb_finish(&sb);
+}
+
+/* here_op - If word is [n]<<, [n]<<- or [n]<<<, return the operator part */
+static char *here_op(char *word) {
+    word += strspn(word, "0123456789");
+    if (strcmp(word, "<<") == 0 || strcmp(word, "<<-") == 0 || strcmp(word, "<<<") == 0)
+        return word;
+    return NULL;
+}
+
+/* func_name - Are the first n characters of word a valid function name? */
+static int func_name(const char *word, size_t n) {
+    size_t i;
+
+    if (n == 0 || !(isalpha((unsigned char)word[0]) || word[0] == '_'))
+        return 0;
+    for (i = 1; i < n; i++)
+        if (!isalnum((unsigned char)word[i]) && !strchr("_.-", word[i]))
+            return 0;
+    return 1;
+}
+
+/*
+ * func_parens - If word ends in "()", or in "(){" with the brace
+ *    attached, return where the "()" starts and set *brace to whether
+ *    the '{' was there; otherwise return -1.
+ */
+static int func_parens(const char *word, int *brace) {
+    size_t len = strlen(word);
+
+    *brace = len > 0 && word[len - 1] == '{';
+    len -= *brace;
+    if (len < 2 || strncmp(word + len - 2, "()", 2) != 0)
+        return -1;
+    return len - 2;
+}
+
+/*
+ * parse_func - name() { list; }, once the name and the parens have been
+ *    read, and with brace set the '{' too. The name is stored as
+ *    cmd.argv[0] and the list as the body.
+ */
+static struct node_t *parse_func(struct parser_t *ps, char *name, int brace) {
+    static const char *brace_stop[] = {"}", NULL};
+    struct node_t *n = new_node(N_FUNC);
+    struct token_t *t;
+
+    add_word(&n->cmd, name, 0);
+    if (!brace) {
+        while ((t = peek(ps))->type == T_SEP)   /* the { may be on the next line */
+            skip(ps);
+        if (t->type == T_EOF) {
+            ps->status = P_INCOMPLETE;
+            return n;
+        }
+        if (!expect(ps, "{"))
+            return n;
+    }
+    n->body = parse_list(ps, brace_stop);
+    expect(ps, "}");
+    return n;
+}
+
+/*
+ * parse_simple - Words up to a separator, or up to and including '&'.
+ *    A here-document becomes the word "<<" (or "2<<", say) followed by
+ *    its body, and a
+ *    process substitution "<(" or ">(" followed by its command text.
+ *    name () starts a function definition instead.
+ */
+static struct node_t *parse_simple(struct parser_t *ps) {
+    struct node_t *n = new_node(N_CMD);
+    struct token_t *t = peek(ps);
+    const char *start = t->start, *end = t->start;
+    int amp, strip, expand, brace, plain = !t->quoted && !t->expand;
+    char *body, *op;
+
+    while (t->type == T_WORD) {
+        if (n->cmd.argc == 1 && plain && !t->quoted && func_parens(t->word, &brace) == 0 &&
+            func_name(n->cmd.argv[0], strlen(n->cmd.argv[0]))) {
+            body = n->cmd.argv[0];      /* name () or name (){ */
+            skip(ps);
+            free(n->cmd.argv);
+            free(n->cmd.lit);
+            free(n);
+            return parse_func(ps, body, brace);
+        }
+        amp = !t->quoted && strcmp(t->word, "&") == 0;
+        if (t->procsub) {
+            add_word(&n->cmd, strdup(t->procsub == '<' ? "<(" : ">("), 0);
+            add_word(&n->cmd, t->word, 0);
+            n->cmd.lit[n->cmd.argc - 1] = 1;
+            end = t->end;
+            consume(ps);
+            t = peek(ps);
+            continue;
+        }
+        op = t->quoted ? NULL : here_op(t->word);
+        if (op && op[2] != '<') {
+            strip = op[2] == '-';
+            op[2] = '\0';
+            add_word(&n->cmd, t->word, 0);
+            consume(ps);
+            t = peek(ps);
+            if (t->type != T_WORD) {
+                syntax_error(ps, t);
+                break;
+            }
+            body = read_heredoc(ps, t, strip, &expand);
+            add_word(&n->cmd, body, expand);
+            n->cmd.lit[n->cmd.argc - 1] = 1;
+            skip(ps);
+            end = t->end;
+            t = peek(ps);
+            continue;
+        }
+        add_word(&n->cmd, t->word, t->expand);
+        n->cmd.lit[n->cmd.argc - 1] = t->lit;
+        end = t->end;
+        consume(ps);
+        if (amp)
+            break;
+        t = peek(ps);
+    }
+
+    /* The job list wants the text newline terminated, like fgets gives */
+    n->cmd.text = malloc(end - start + 2);
+    if (!n->cmd.text)
+        unix_error("malloc error");
+    memcpy(n->cmd.text, start, end - start);
+    strcpy(n->cmd.text + (end - start), "\n");
+    return n;
+}
+
+/* parse_if - if list; then list; [elif ...] [else list;] fi */
+static struct node_t *parse_if(struct parser_t *ps) {
+    static const char *then_stop[] = {"then", NULL};
+    static const char *else_stop[] = {"elif", "else", "fi", NULL};
+    static const char *fi_stop[] = {"fi", NULL};
+    struct node_t *n = new_node(N_IF);
+
+    skip(ps);                           /* "if" or "elif" */
+    n->cond = parse_list(ps, then_stop);
+    if (!expect(ps, "then"))
+        return n;
+    n->body = parse_list(ps, else_stop);
+    if (ps->status != P_OK)
+        return n;
+    if (keyword(peek(ps), "elif")) {    /* the nested if eats the "fi" */
+        n->alt = parse_if(ps);
+        return n;
+    }
+    if (keyword(peek(ps), "else")) {
+        skip(ps);
+        n->alt = parse_list(ps, fi_stop);
+    }
+    expect(ps, "fi");
+    return n;
+}
+
+/* parse_while - while list; do list; done */
+static struct node_t *parse_while(struct parser_t *ps) {
+    static const char *do_stop[] = {"do", NULL};
+    static const char *done_stop[] = {"done", NULL};
+    struct node_t *n = new_node(N_WHILE);
+
+    skip(ps);
+    n->cond = parse_list(ps, do_stop);
+    if (!expect(ps, "do"))
+        return n;
+    n->body = parse_list(ps, done_stop);
+    expect(ps, "done");
+    return n;
+}
+
+/*
+ * parse_for - for name [in words]; do list; done
+ *    The loop variable is stored as cmd.argv[0], the words after it.
+ *    Without "in" the words are the function's arguments.
+ */
+static struct node_t *parse_for(struct parser_t *ps) {
+    static const char *done_stop[] = {"done", NULL};
+    struct node_t *n = new_node(N_FOR);
+    struct token_t *t;
+
+    skip(ps);
+    t = peek(ps);
+    if (t->type != T_WORD || t->quoted || t->expand ||
+        !(isalpha((unsigned char)t->word[0]) || t->word[0] == '_')) {
+        if (t->type == T_EOF)
+            ps->status = P_INCOMPLETE;
+        syntax_error(ps, t);
+        return n;
+    }
+    add_word(&n->cmd, t->word, 0);
+    consume(ps);
+
+    if (keyword(peek(ps), "in")) {
+        skip(ps);
+        while ((t = peek(ps))->type == T_WORD) {
+            add_word(&n->cmd, t->word, t->expand);
+            consume(ps);
+        }
+    }
+    else {                              /* for name; loops over "$@" */
+        add_word(&n->cmd, strdup("\002$@"), 1);
+    }
+    while ((t = peek(ps))->type == T_SEP)
+        skip(ps);
+    if (t->type == T_EOF) {
+        ps->status = P_INCOMPLETE;
+        return n;
+    }
+    if (!expect(ps, "do"))
+        return n;
+    n->body = parse_list(ps, done_stop);
+    expect(ps, "done");
+    return n;
+}
+
+/*
+ * parse_list - Parse commands until EOF or, when stop is given, until
+ *    one of the stop keywords shows up in command position. The stop
+ *    keyword is left as the lookahead token.
+ */
+static struct node_t *parse_list(struct parser_t *ps, const char **stop) {
+    struct node_t *head = NULL, **tail = &head;
+    struct token_t *t;
+    int len, brace;
+
+    while (ps->status == P_OK) {
+        t = peek(ps);
+        if (t->type == T_SEP) {
+            skip(ps);
+            continue;
+        }
+        if (t->type == T_EOF) {
+            if (stop)
+                ps->status = P_INCOMPLETE;
+            break;
+        }
+        if (in_list(t, stop))
+            break;
+
+        if (keyword(t, "if"))
+            *tail = parse_if(ps);
+        else if (keyword(t, "while"))
+            *tail = parse_while(ps);
+        else if (keyword(t, "for"))
+            *tail = parse_for(ps);
+        else if (!t->quoted && !t->expand && (len = func_parens(t->word, &brace)) > 0 &&
+                 func_name(t->word, len)) {
+            t->word[len] = '\0';         /* name() or name(){ */
+            consume(ps);
+            *tail = parse_func(ps, t->word, brace);
+        }
+        else if (in_list(t, reserved) || keyword(t, "&") || keyword(t, "|")) {
+            syntax_error(ps, t);        /* no command before it */
+            break;
+        }
+        else
+            *tail = parse_simple(ps);
+        tail = &(*tail)->next;
+    }
+    return head;
+}
+
+/*
+ * parse_script - Parse text into a list of nodes. On success the list
+ *    is stored in *list and P_OK is returned; otherwise *list is NULL
+ *    and the return value says whether more input could complete it.
+ *    If here isn't NULL it is set to the here-document the text ends
+ *    inside, if any; only main's read loop, which can supply the rest
+ *    of the body, asks.
+ */
+int parse_script(const char *text, struct node_t **list, struct heredoc_t *here) {
+    struct parser_t ps;
+
+    memset(&ps, 0, sizeof(ps));
+    ps.p = text;
+    ps.status = P_OK;
+    *list = parse_list(&ps, NULL);
+    if (ps.have_tok)
+        free(ps.tok.word);
+    if (ps.status != P_OK) {
+        free_nodes(*list);
+        *list = NULL;
+    }
+    if (here && ps.status == P_INCOMPLETE) {
+        free(here->delim);
+        *here = ps.here;
+    }
+    else
+        free(ps.here.delim);
+    return ps.status;
+}
+
+/* free_words - Free a command's words */
+static void free_words(struct cmd_t *cmd) {
+    int i;
+
+    for (i = 0; i < cmd->argc; i++)
+        free(cmd->argv[i]);
+    free(cmd->argv);
+    free(cmd->lit);
+}
+
+/* free_nodes - Free a node list and everything hanging off it */
+void free_nodes(struct node_t *node) {
+    struct node_t *next;
+
+    if (SNAP_HAS(node))                 /* runs in place from the image */
+        return;
+    for (; node; node = next) {
+        next = node->next;
+        free_words(&node->cmd);
+        free(node->cmd.text);
+        free_nodes(node->cond);
+        free_nodes(node->body);
+        free_nodes(node->alt);
+        free(node);
+    }
+}
+
+/* copy_nodes - Return a copy of a node list and everything under it */
+struct node_t *copy_nodes(const struct node_t *node) {
+    struct node_t *first = NULL, **link = &first, *n;
+    char *word;
+    int i;
+
+    for (; node; node = node->next) {
+        n = new_node(node->type);
+        n->cond = copy_nodes(node->cond);
+        n->body = copy_nodes(node->body);
+        n->alt = copy_nodes(node->alt);
+        for (i = 0; i < node->cmd.argc; i++) {
+            if ((word = strdup(node->cmd.argv[i])) == NULL)
+                unix_error("strdup error");
+            add_word(&n->cmd, word, node->cmd.expand);
+            n->cmd.lit[i] = node->cmd.lit[i];
+        }
+        if (node->cmd.text && (n->cmd.text = strdup(node->cmd.text)) == NULL)
+            unix_error("strdup error");
+        *link = n;
+        link = &n->next;
+    }
+    return first;
+}
+
+/*
+ * expand - Return a malloc'd copy of word with $name, ${name}, $?, $$,
+ *    the function arguments $1 ... ${10} ..., $#, $@ and $*, and $(...)
+ *    replaced by their values. With split, blanks in the output of a
+ *    $(...) or in $@ and $* outside double quotes become FIELD_SEP, as
+ *    do the gaps between the arguments of $@ (quoted or not) and of $*,
+ *    and *subst is set if there was anything to split.
+ */
+static char *expand(const char *word, int split, int *subst) {
+    struct strbuf_t sb = {0}, name = {0};
+    const char *p = word, *end;
+    char num[16], *text, *value;
+    size_t start;
+    int dq, i;
+
+    while (*p) {
+        if (*p == QUOTE_ESC && p[1]) {  /* single quoted, keep as is */
+            sb_putc(&sb, p[1]);
+            p += 2;
+            continue;
+        }
+        dq = *p == SUBST_DQ;
+        if (dq)
+            p++;
+        if (*p != '$') {
+            sb_putc(&sb, *p++);
+            continue;
+        }
+        p++;
+        if (*p == '(' && (end = subst_end(p + 1)) != NULL) {
+            if ((text = strndup(p + 1, end - (p + 1))) == NULL)
+                unix_error("strndup error");
+            start = sb.len;
+            capture(text, &sb);
+            free(text);
+            if (split && !dq) {
+                for (; start < sb.len; start++)
+                    if (sb.s[start] == ' ' || sb.s[start] == '\t' || sb.s[start] == '\n')
+                        sb.s[start] = FIELD_SEP;
+                *subst = 1;
+            }
+            p = end + 1;
+            continue;
+        }
+        if (*p == '?' || *p == '$' || *p == '#') {
+            snprintf(num, sizeof(num), "%d",
+                     *p == '?' ? last_status : *p == '#' ? posc : (int)getpid());
+            sb_puts(&sb, num);
+            p++;
+            continue;
+        }
+        if (*p >= '1' && *p <= '9') {
+            if (*p - '0' <= posc)
+                sb_puts(&sb, posv[*p - '0']);
+            p++;
+            continue;
+        }
+        if (*p == '@' || *p == '*') {
+            for (i = 1; i <= posc; i++) {
+                if (i > 1)
+                    sb_putc(&sb, split && !(dq && *p == '*') ? FIELD_SEP : ' ');
+                start = sb.len;
+                sb_puts(&sb, posv[i]);
+                if (split && !dq)
+                    for (; start < sb.len; start++)
+                        if (sb.s[start] == ' ' || sb.s[start] == '\t' || sb.s[start] == '\n')
+                            sb.s[start] = FIELD_SEP;
+            }
+            if (split && !(dq && *p == '*'))
+                *subst = 1;
+            p++;
+            continue;
+        }
+        if (*p == '{' && (end = strchr(p, '}')) != NULL) {
+            p++;
+        }
+        else if (isalpha((unsigned char)*p) || *p == '_') {
+            for (end = p; isalnum((unsigned char)*end) || *end == '_'; end++)
+                ;
+        }
+        else {                          /* a lone '$' */
+            sb_putc(&sb, '$');
+            continue;
+        }
+        name.len = 0;
+        sb_putn(&name, p, end - p);
+        if (isdigit((unsigned char)*name.s))    /* ${10} and up */
+            value = atoi(name.s) >= 1 && atoi(name.s) <= posc ? posv[atoi(name.s)] : NULL;
+        else
+            value = getvar(name.s);
+        if (value != NULL)
+            sb_puts(&sb, value);
+        p = *end == '}' ? end + 1 : end;
+    }
+    free(name.s);
+    return sb_finish(&sb);
+}
+
+/*
+ * expand_word - Return a malloc'd copy of word with its $ expansions
+ *    replaced by their values, as a single word.
+ */
+char *expand_word(const char *word) {
+    return expand(word, 0, NULL);
+}
+
+/*
+ * expand_fields - Expand word and add the result to cmd. The output of
+ *    an unquoted $(...) is split into words on blanks and newlines, $@
+ *    gives a word per argument, and a word that comes to nothing that
+ *    way is dropped.
+ */
+static void expand_fields(const char *word, struct cmd_t *cmd) {
+    int subst = 0;
+    char *str = expand(word, 1, &subst), *p, *sep;
+
+    if (!subst) {
+        add_word(cmd, str, 0);
+        return;
+    }
+    for (p = str; *p; p = *sep ? sep + 1 : sep) {
+        sep = strchrnul(p, FIELD_SEP);
+        if (sep > p && (word = strndup(p, sep - p)) != NULL)
+            add_word(cmd, (char *)word, 0);
+    }
+    free(str);
+}
+
+/* sb_write - fopencookie write function appending to a strbuf */
+static ssize_t sb_write(void *cookie, const char *buf, size_t n) {
+    sb_putn(cookie, buf, n);
+    return n;
+}
+
+/*
+ * inprocess - Can a $(...) run without a fork? A lone builtin whose
+ *    whole effect is what it prints can (1), and so can a lone call of
+ *    a function (2), with no pipes, redirections or & around either.
+ */
+static int inprocess(struct node_t *ast) {
+    static const char *builtins[] = {"pwd", "jobs", NULL};
+    const char **w;
+    char *word;
+    int i;
+
+    if (!ast || ast->next || ast->type != N_CMD || ast->cmd.argc == 0 ||
+        getdef(aliastab, ast->cmd.argv[0]))
+        return 0;
+    for (i = 0; i < ast->cmd.argc; i++) {
+        word = ast->cmd.argv[i];
+        if (!IS_LIT(ast->cmd.lit, i) &&
+            (strcmp(word, "|") == 0 || strcmp(word, "&") == 0 || strcmp(word, "<(") == 0 ||
+             strcmp(word, ">(") == 0 || redir_op(word, NULL, NULL, NULL)))
+            return 0;
+    }
+    for (w = builtins; *w; w++)
+        if (strcmp(ast->cmd.argv[0], *w) == 0)
+            return 1;
+    return getdef(functab, ast->cmd.argv[0]) ? 2 : 0;
+}
+
+/*
+ * capture - Run the text of a $(...) and append its output, without
+ *    trailing newlines, to sb; $? becomes its status. The text is parsed
+ *    once and cached. A builtin that only prints runs right here with
+ *    stdout writing into sb. So does a function, but as it may run
+ *    commands of its own its fd 1 goes to a memfd, which can't fill up
+ *    while nobody reads it; its variable changes stay, as with any
+ *    function call. Anything else runs in a forked subshell whose
+ *    output is read straight into sb through a pipe.
+ */
+void capture(const char *text, struct strbuf_t *sb) {
+    static cookie_io_functions_t io = { NULL, sb_write, NULL, NULL };
+    struct subst_t *sub;
+    unsigned h = varhash(text);
+    size_t start = sb->len;
+    sigset_t old, empty;
+    FILE *out, *saved;
+    int fd[2] = {-1, -1}, status, mode, out_fd, rc, notices = notice_fd;
+    ssize_t n;
+    pid_t pid = 0;
+
+    for (sub = substtab[h]; sub; sub = sub->next)
+        if (strcmp(sub->text, text) == 0)
+            break;
+    if (!sub) {
+        if ((sub = calloc(1, sizeof(struct subst_t))) == NULL ||
+            (sub->text = strdup(text)) == NULL)
+            unix_error("malloc error");
+        if ((rc = parse_script(text, &sub->ast, NULL)) != P_OK) {
+            if (rc == P_INCOMPLETE)
+                printf("syntax error: unexpected end of file\n");
+            free(sub->text);
+            free(sub);
+            last_status = 2;
+            return;
+        }
+        sub->next = substtab[h];
+        substtab[h] = sub;
+    }
+
+    /* Nothing else may print into the capture or reap the subshell */
+    block_sigchld(&old);
+    fflush(stdout);
+    mode = inprocess(sub->ast);
+    if (mode == 1 && (out = fopencookie(sb, "w", io)) != NULL) {
+        saved = stdout;
+        stdout = out;
+        if (notices == -1)          /* job notices still go to fd 1 */
+            notice_fd = STDOUT_FILENO;
+        exec_list(sub->ast);
+        fclose(out);
+        stdout = saved;
+        notice_fd = notices;
+    }
+    else if (mode == 2 && (fd[0] = memfd_create("tsh-subst", MFD_CLOEXEC)) != -1) {
+        out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0); /* -1 if closed */
+        dup2(fd[0], STDOUT_FILENO);
+        if (notices == -1)          /* ... and here to the old fd 1 */
+            notice_fd = out_fd == -1 ? STDERR_FILENO : out_fd;
+        exec_list(sub->ast);
+        fflush(stdout);
+        notice_fd = notices;
+        if (out_fd == -1) {
+            close(STDOUT_FILENO);
+        }
+        else {
+            dup2(out_fd, STDOUT_FILENO);
+            close(out_fd);
+        }
+        lseek(fd[0], 0, SEEK_SET);
+    }
+    else {
+        if (pipe(fd) == -1)
+            unix_error("pipe error");
+        fcntl(fd[0], F_SETPIPE_SZ, 1 << 20); /* fewer, larger reads */
+        if ((pid = fork()) == -1)
+            unix_error("fork error");
+        if (pid == 0) {
+            close(fd[0]);
+            if (fd[1] != STDOUT_FILENO) {
+                dup2(fd[1], STDOUT_FILENO);
+                close(fd[1]);
+            }
+            subshell = 1;
+            Signal(SIGINT, SIG_DFL);
+            Signal(SIGTSTP, SIG_DFL);
+            Signal(SIGCHLD, SIG_DFL);
+            sigemptyset(&empty);
+            sigprocmask(SIG_SETMASK, &empty, NULL);
+            exec_list(sub->ast);
+            fflush(stdout);
+            exit(last_status);
+        }
+        close(fd[1]);
+    }
+    if (fd[0] != -1) {
+        while (1) {
+            sb_grow(sb, 1 << 16);
+            n = read(fd[0], sb->s + sb->len, sb->cap - sb->len - 1);
+            if (n == -1 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            sb->len += n;
+        }
+        close(fd[0]);
+    }
+    if (pid > 0) {
+        while (waitpid(pid, &status, 0) == -1 && errno == EINTR)
+            ;
+        last_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+
+    while (sb->len > start && sb->s[sb->len - 1] == '\n')
+        sb->len--;
+    sb_finish(sb);
+}
+
+/*
+ * run_words - Expand a simple command's words if it needs it and hand
+ *    it to eval_cmd. NAME=value on its own sets a shell variable.
+ */
+static void run_words(struct cmd_t *cmd) {
+    struct cmd_t words = {0};
+    struct strbuf_t text = {0};
+    char **argv, *eq, *value, *prev;
+    int i, k;
+
+    eq = strchr(cmd->argv[0], '=');
+    if (cmd->argc == 1 && eq && eq != cmd->argv[0] &&
+        strspn(cmd->argv[0], "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ"
+               "0123456789_") == (size_t)(eq - cmd->argv[0]) &&
+        !isdigit((unsigned char)cmd->argv[0][0])) {
+        last_status = 0;                /* unless a $(...) sets it */
+        value = cmd->expand ? expand_word(eq + 1) : NULL;
+        *eq = '\0';
+        setvar(cmd->argv[0], value ? value : eq + 1);
+        *eq = '=';
+        free(value);
+        return;
+    }
+
+    if (!cmd->expand) {
+        if ((argv = malloc((cmd->argc + 1) * sizeof(char *))) == NULL)
+            unix_error("malloc error");
+        memcpy(argv, cmd->argv, (cmd->argc + 1) * sizeof(char *));
+        eval_cmd(cmd->text, cmd->argc, argv, cmd->lit);
+        free(argv);
+        return;
+    }
+
+    for (i = 0; i < cmd->argc; i++) {
+        prev = i > 0 && !cmd->lit[i - 1] ? cmd->argv[i - 1] : "";
+        k = words.argc;
+        if (strcmp(prev, "<(") == 0 || strcmp(prev, ">(") == 0)
+            add_word(&words, strdup(cmd->argv[i]), 0); /* expanded by the subshell */
+        else if (here_op(prev) || (i > 0 && strcmp(cmd->argv[0], "local") == 0))
+            add_word(&words, expand_word(cmd->argv[i]), 0); /* never split */
+        else
+            expand_fields(cmd->argv[i], &words);
+        for (; k < words.argc; k++)
+            words.lit[k] = cmd->lit[i];
+    }
+    for (i = 0; i < words.argc; i++) {
+        if (i > 0 && !words.lit[i - 1] && (prev = here_op(words.argv[i - 1])) &&
+            prev[2] != '<')
+            continue;                   /* no here-document bodies */
+        sb_puts(&text, i ? " " : "");
+        sb_puts(&text, words.argv[i]);
+    }
+    sb_putc(&text, '\n');
+
+    eval_cmd(text.s, words.argc, words.argv, words.lit);
+    free_words(&words);
+    free(text.s);
+}
+
+/*
+ * run_alias - Run a command whose first word is the alias al: every
+ *    command of the alias but the last as it is, then the last with the
+ *    rest of the command's words added to it. An alias is not expanded
+ *    again while it runs, so one can use a command of the same name.
+ */
+static void run_alias(struct def_t *al, struct cmd_t *cmd) {
+    struct cmd_t words = {0};
+    struct node_t *n = al->ast;
+    int i;
+
+    al->refs++;                         /* unalias may run meanwhile */
+    for (; n && n->next && !interrupted && !returning; n = n->next)
+        exec_node(n);
+    if (interrupted || returning)
+        ;
+    else if (!n || n->type == N_CMD) {
+        for (i = 0; n && i < n->cmd.argc; i++) {
+            add_word(&words, n->cmd.argv[i], n->cmd.expand);
+            words.lit[words.argc - 1] = n->cmd.lit[i];
+        }
+        for (i = 1; i < cmd->argc; i++) {
+            add_word(&words, cmd->argv[i], cmd->expand);
+            words.lit[words.argc - 1] = cmd->lit[i];
+        }
+        if (words.argc) {
+            words.text = join_argv(words.argv, words.argc);
+            run_words(&words);
+        }
+        else
+            last_status = 0;
+        free(words.argv);               /* the words are borrowed */
+        free(words.lit);
+        free(words.text);
+    }
+    else if (cmd->argc > 1) {           /* words after an if/for/while */
+        printf("syntax error near unexpected token `%s'\n", cmd->argv[1]);
+        last_status = 2;
+    }
+    else
+        exec_node(n);
+    drop_def(al);
+}
+
+/*
+ * run_cmd - Run a simple command, expanding an alias in command
+ *    position with one hash lookup
+ */
+static void run_cmd(struct cmd_t *cmd) {
+    struct def_t *al = getdef(aliastab, cmd->argv[0]);
+
+    if (al && al->refs == 1)            /* more refs: it is running */
+        run_alias(al, cmd);
+    else
+        run_words(cmd);
+}
+
+/*
+ * exec_node - Run one parsed node. Loop bodies are run straight from
+ *    the tree, so only expansion and execution happen per iteration.
+ *    A function definition stores a copy of its body, since the tree it
+ *    came from may be freed or reparsed.
+ */
+void exec_node(struct node_t *node) {
+    struct cmd_t words;
+    int i;
+
+    switch (node->type) {
+        case N_CMD:
+            run_cmd(&node->cmd);
+            break;
+        case N_IF:
+            exec_list(node->cond);
+            if (interrupted || returning)
+                return;
+            if (last_status == 0)
+                exec_list(node->body);
+            else if (node->alt)
+                exec_list(node->alt);
+            else
+                last_status = 0;
+            break;
+        case N_WHILE:
+            while (!interrupted && !returning) {
+                exec_list(node->cond);
+                if (last_status != 0 || returning)
+                    break;
+                exec_list(node->body);
+            }
+            if (!returning)
+                last_status = 0;
+            break;
+        case N_FOR:
+            words = node->cmd;          /* the name, then the words */
+            if (node->cmd.expand) {
+                memset(&words, 0, sizeof(words));
+                add_word(&words, strdup(node->cmd.argv[0]), 0);
+                for (i = 1; i < node->cmd.argc; i++)
+                    expand_fields(node->cmd.argv[i], &words);
+            }
+            for (i = 1; i < words.argc && !interrupted && !returning; i++) {
+                setvar(words.argv[0], words.argv[i]);
+                exec_list(node->body);
+            }
+            if (node->cmd.expand)
+                free_words(&words);
+            break;
+        case N_FUNC:
+            setdef(functab, node->cmd.argv[0], copy_nodes(node->body), NULL);
+            last_status = 0;
+            break;
+    }
+}
+
+/*
+ * exec_list - Run a parsed node list. A ctrl-c abandons whatever is
+ *    left of it, and so does a return in a function.
+ */
+void exec_list(struct node_t *node) {
+    for (; node && !interrupted && !returning; node = node->next)
+        exec_node(node);
+}
+
+/* varhash - FNV-1a hash of a variable name */
+static unsigned varhash(const char *name) {
+    unsigned h = 2166136261u;
+
+    while (*name)
+        h = (h ^ (unsigned char)*name++) * 16777619u;
+    return h % VARHASH;
+}
+
+/* findvar - Value of a variable set in this shell, or NULL */
+static char *findvar(const char *name) {
+    struct var_t *v;
+
+    for (v = vartab[varhash(name)]; v; v = v->next)
+        if (strcmp(v->name, name) == 0)
+            return v->value;
+    return NULL;
+}
+
+/* getvar - Value of a shell variable, falling back to the snapshot and
+ *    then the environment. setvar shadows snapshot values. */
+char *getvar(const char *name) {
+    const char *value;
+
+    if ((value = findvar(name)) != NULL)
+        return (char *)value;
+    if ((value = snap_getvar(name)) != NULL)
+        return (char *)value;
+    return getenv(name);
+}
+
+/* setvar - Create or update a shell variable */
+void setvar(const char *name, const char *value) {
+    struct var_t *v;
+    unsigned h = varhash(name);
+
+    for (v = vartab[h]; v; v = v->next)
+        if (strcmp(v->name, name) == 0)
+            break;
+    if (!v) {
+        if ((v = calloc(1, sizeof(struct var_t))) == NULL ||
+            (v->name = strdup(name)) == NULL)
+            unix_error("setvar error");
+        v->next = vartab[h];
+        vartab[h] = v;
+    }
+    free(v->value);
+    if ((v->value = strdup(value)) == NULL)
+        unix_error("setvar error");
+}
+
+/*
+ * do_source - Execute the builtin source command. Files are parsed once
+ *    and kept, keyed on path, mtime and size, so sourcing an unchanged
+ *    file again costs a single stat.
+ */
+void do_source(char **argv) {
+    struct script_t *sc;
+    struct stat st;
+    struct strbuf_t sb = {0};
+    struct node_t *ast;
+    char buf[8192];
+    ssize_t n;
+    int fd, rc;
+
+    if (!argv[1]) {
+        printf("%s: filename argument required\n", argv[0]);
+        last_status = 2;
+        return;
+    }
+    if (stat(argv[1], &st) == -1) {
+        printf("%s: %s\n", argv[1], strerror(errno));
+        last_status = 1;
+        return;
+    }
+
+    for (sc = scripts; sc; sc = sc->next)
+        if (strcmp(sc->path, argv[1]) == 0)
+            break;
+    if (sc && (sc->size != st.st_size ||
+               sc->mtime.tv_sec != st.st_mtim.tv_sec ||
+               sc->mtime.tv_nsec != st.st_mtim.tv_nsec)) {
+        /* Stale. If it is still running further up the stack it has to
+         * stay alive; a fresh entry in front of it shadows it. */
+        if (!sc->busy) {
+            free_nodes(sc->ast);
+            sc->ast = NULL;
+        }
+        else {
+            sc = NULL;
+        }
+    }
+
+    if (!sc && (ast = snap_script(argv[1], &st)) != NULL) {
+        /* Parsed when the snapshot was taken */
+        if ((sc = calloc(1, sizeof(struct script_t))) == NULL ||
+            (sc->path = strdup(argv[1])) == NULL)
+            unix_error("source error");
+        sc->next = scripts;
+        scripts = sc;
+        sc->ast = ast;
+        sc->mtime = st.st_mtim;
+        sc->size = st.st_size;
+    }
+
+    if (!sc || !sc->ast) {
+        if ((fd = open(argv[1], O_RDONLY | O_CLOEXEC)) == -1) {
+            printf("%s: %s\n", argv[1], strerror(errno));
+            last_status = 1;
+            return;
+        }
+        fstat(fd, &st);
+        while ((n = read(fd, buf, sizeof(buf))) > 0) {
+            sb_grow(&sb, n);
+            memcpy(sb.s + sb.len, buf, n);
+            sb.len += n;
+        }
+        close(fd);
+        rc = parse_script(sb_finish(&sb), &ast, NULL);
+        free(sb.s);
+        if (rc != P_OK) {
+            if (rc == P_INCOMPLETE)
+                printf("%s: syntax error: unexpected end of file\n", argv[1]);
+            last_status = 2;
+            return;
+        }
+        if (!sc) {
+            if ((sc = calloc(1, sizeof(struct script_t))) == NULL ||
+                (sc->path = strdup(argv[1])) == NULL)
+                unix_error("source error");
+            sc->next = scripts;
+            scripts = sc;
+        }
+        sc->ast = ast;
+        sc->mtime = st.st_mtim;
+        sc->size = st.st_size;
+    }
+
+    last_status = 0;
+    sc->busy++;
+    exec_list(sc->ast);
+    sc->busy--;
+}
+
+/*
+ * getdef - The function or alias called name in tab, or NULL
+ */
+struct def_t *getdef(struct def_t **tab, const char *name) {
+    struct def_t *def;
+
+    for (def = tab[varhash(name)]; def; def = def->next)
+        if (strcmp(def->name, name) == 0)
+            return def;
+    return NULL;
+}
+
+/*
+ * setdef - Make ast (and for an alias, text) the definition of name
+ *    in tab. The table takes over ast. An old definition that is still
+ *    running stays alive until it is done.
+ */
+void setdef(struct def_t **tab, const char *name, struct node_t *ast, const char *text) {
+    struct def_t *def;
+    unsigned h = varhash(name);
+
+    deldef(tab, name);
+    if ((def = calloc(1, sizeof(struct def_t))) == NULL ||
+        (def->name = strdup(name)) == NULL ||
+        (text && (def->text = strdup(text)) == NULL))
+        unix_error("malloc error");
+    def->ast = ast;
+    def->refs = 1;
+    def->next = tab[h];
+    tab[h] = def;
+}
+
+/* deldef - Remove name from tab; 0 if it wasn't there */
+int deldef(struct def_t **tab, const char *name) {
+    struct def_t *def, **link;
+
+    for (link = &tab[varhash(name)]; (def = *link) != NULL; link = &def->next) {
+        if (strcmp(def->name, name) == 0) {
+            *link = def->next;
+            drop_def(def);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* drop_def - Give up a reference to a definition, freeing it with the last */
+void drop_def(struct def_t *def) {
+    if (--def->refs > 0)
+        return;
+    free_nodes(def->ast);
+    free(def->name);
+    free(def->text);
+    free(def);
+}
+
+/* unsetvar - Remove a shell variable, uncovering any snapshot or
+ *    environment value of the same name */
+static void unsetvar(const char *name) {
+    struct var_t *v, **link;
+
+    for (link = &vartab[varhash(name)]; (v = *link) != NULL; link = &v->next) {
+        if (strcmp(v->name, name) == 0) {
+            *link = v->next;
+            free(v->name);
+            free(v->value);
+            free(v);
+            return;
+        }
+    }
+}
+
+/*
+ * call_func - Run a shell function right here in the shell with argv
+ *    as its arguments ($1 is argv[1]). Its arguments and local variables
+ *    are put back as they were when it returns.
+ */
+void call_func(struct def_t *func, int argc, char **argv) {
+    struct local_t *outer = locals, *l;
+    char **outer_posv = posv;
+    int outer_posc = posc;
+
+    if (funcdepth >= MAXFUNCNEST) {
+        printf("%s: maximum function nesting level exceeded (%d)\n", argv[0], MAXFUNCNEST);
+        last_status = 1;
+        return;
+    }
+    func->refs++;                       /* it may redefine itself */
+    funcdepth++;
+    locals = NULL;
+    posc = argc - 1;
+    posv = argv;
+    last_status = 0;
+    exec_list(func->ast);
+    returning = 0;
+
+    while ((l = locals) != NULL) {
+        locals = l->next;
+        if (l->saved)
+            setvar(l->name, l->saved);
+        else
+            unsetvar(l->name);
+        free(l->name);
+        free(l->saved);
+        free(l);
+    }
+    locals = outer;
+    posc = outer_posc;
+    posv = outer_posv;
+    funcdepth--;
+    drop_def(func);
+}
+
+/*
+ * func_exit - In a child process, run the builtin or function argv[0]
+ *    names, if there is one, and exit with its status. Used where one
+ *    needs a process of its own: in the background, in a pipeline or
+ *    with redirections.
+ */
+void func_exit(char **argv) {
+    struct def_t *func = getdef(functab, argv[0]);
+    int argc;
+
+    if (!func && !is_builtin(argv[0]))
+        return;
+    subshell = 1;                       /* no job control in here */
+    if (is_builtin(argv[0])) {
+        argv_lit = NULL;                /* none of them look at it */
+        builtin_cmd(argv);
+    }
+    else {
+        for (argc = 0; argv[argc]; argc++)
+            ;
+        call_func(func, argc, argv);
+    }
+    fflush(stdout);
+    exit(last_status);
+}
+
+/* print_alias - Print an alias the way it can be given back to alias */
+static void print_alias(struct def_t *al) {
+    const char *p;
+
+    printf("alias %s='", al->name);
+    for (p = al->text; *p; p++) {
+        if (*p == '\'')
+            printf("'\\''");
+        else
+            putchar(*p);
+    }
+    printf("'\n");
+}
+
+/*
+ * do_alias - Execute the builtin alias command:
+ *    alias [name[=value] ...]
+ *    Defines each name=value, with value parsed now, and prints the
+ *    aliases given by name, or all of them.
+ */
+void do_alias(char **argv) {
+    struct node_t *ast;
+    struct def_t *al;
+    char *eq;
+    int i, rc;
+
+    last_status = 0;
+    if (!argv[1]) {
+        for (i = 0; i < VARHASH; i++)
+            for (al = aliastab[i]; al; al = al->next)
+                print_alias(al);
+        return;
+    }
+    for (i = 1; argv[i]; i++) {
+        if ((eq = strchr(argv[i], '=')) == NULL) {
+            if ((al = getdef(aliastab, argv[i])) != NULL)
+                print_alias(al);
+            else {
+                printf("alias: %s: not found\n", argv[i]);
+                last_status = 1;
+            }
+            continue;
+        }
+        *eq = '\0';
+        if (eq == argv[i] || argv[i][strcspn(argv[i], " \t/$'\"\\`")]) {
+            printf("alias: `%s': invalid alias name\n", argv[i]);
+            last_status = 1;
+        }
+        else if ((rc = parse_script(eq + 1, &ast, NULL)) != P_OK) {
+            if (rc == P_INCOMPLETE)
+                printf("alias: %s: syntax error: unexpected end of value\n", argv[i]);
+            last_status = 2;
+        }
+        else
+            setdef(aliastab, argv[i], ast, eq + 1);
+        *eq = '=';
+    }
+}
+
+/*
+ * do_unalias - Execute the builtin unalias command:
+ *    unalias -a | name ...
+ */
+void do_unalias(char **argv) {
+    struct def_t *al;
+    int i;
+
+    if (!argv[1]) {
+        printf("Usage: unalias -a | name ...\n");
+        last_status = 2;
+        return;
+    }
+    last_status = 0;
+    if (strcmp(argv[1], "-a") == 0) {
+        for (i = 0; i < VARHASH; i++) {
+            while ((al = aliastab[i]) != NULL) {
+                aliastab[i] = al->next;
+                drop_def(al);
+            }
+        }
+        return;
+    }
+    for (i = 1; argv[i]; i++) {
+        if (!deldef(aliastab, argv[i])) {
+            printf("unalias: %s: not found\n", argv[i]);
+            last_status = 1;
+        }
+    }
+}
+
+/*
+ * do_local - Execute the builtin local command:
+ *    local name[=value] ...
+ *    Gives the running function its own copy of each variable, set to
+ *    value (or empty), until it returns. Functions it calls see it too.
+ */
+void do_local(char **argv) {
+    struct local_t *l;
+    char *eq, *value;
+    int i;
+
+    if (funcdepth == 0) {
+        printf("local: can only be used in a function\n");
+        last_status = 1;
+        return;
+    }
+    last_status = 0;
+    for (i = 1; argv[i]; i++) {
+        if ((eq = strchr(argv[i], '=')) != NULL)
+            *eq = '\0';
+        if (!func_name(argv[i], strlen(argv[i])) || strpbrk(argv[i], ".-")) {
+            printf("local: `%s': not a valid identifier\n", argv[i]);
+            last_status = 1;
+        }
+        else {
+            for (l = locals; l && strcmp(l->name, argv[i]) != 0; l = l->next)
+                ;
+            if (!l) {                   /* first time: save the outer value */
+                if ((l = calloc(1, sizeof(struct local_t))) == NULL ||
+                    (l->name = strdup(argv[i])) == NULL)
+                    unix_error("malloc error");
+                if ((value = findvar(argv[i])) != NULL &&
+                    (l->saved = strdup(value)) == NULL)
+                    unix_error("malloc error");
+                l->next = locals;
+                locals = l;
+            }
+            setvar(argv[i], eq ? eq + 1 : "");
+        }
+        if (eq)
+            *eq = '=';
+    }
+}
+
+/*
+ * do_return - Execute the builtin return command:
+ *    return [n]
+ *    Leaves the running function with status n, or with $?.
+ */
+void do_return(char **argv) {
+    if (funcdepth == 0) {
+        printf("return: can only `return' from a function\n");
+        last_status = 1;
+        return;
+    }
+    if (argv[1])
+        last_status = atoi(argv[1]) & 0xff;
+    returning = 1;
+}
+
+/*
+ * do_shift - Execute the builtin shift command:
+ *    shift [n]
+ *    Drops the first n (default 1) of the function's arguments.
+ */
+void do_shift(char **argv) {
+    int n = argv[1] ? atoi(argv[1]) : 1;
+
+    if (n < 0 || n > posc) {
+        printf("shift: %s: shift count out of range\n", argv[1] ? argv[1] : "1");
+        last_status = 1;
+        return;
+    }
+    posv += n;                          /* posv[0] is never read */
+    posc -= n;
+    last_status = 0;
+}
+
+/* 
+ * builtin_cmd - If the user has typed a built-in command then execute
+ *    it immediately and return 1. Return 0 if it isn't a builtin.
+ */
+int builtin_cmd(char **argv) {
+    // Check if its quit, fg, bg, jobs, pwd, source, one of the job scheduling
+    // builtins or one of the ones for functions and aliases
 
     char *cmd = argv[0];
     if(strcmp( cmd, "quit" ) == 0){
       exit(1);
     }
-    else if (strcmp( cmd, "fg" ) == 0){
-      do_bgfg(argv);
+    else if (strcmp( cmd, "fg" ) == 0){
+      do_bgfg(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "bg" ) == 0){
+	  //run bg - SHIREN | TRACE 9
+      do_bgfg(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "jobs" ) == 0){
+	  //run jobs - SHIREN | TRACE 5
+      listjobs(jobs);
+      last_status = 0;
+      return 1;
+    }
+    else if (strcmp( cmd, "source" ) == 0 || strcmp( cmd, "." ) == 0){
+      do_source(argv);
+      return 1;
+    }
+    else if ((strcmp( cmd, "after" ) == 0 && argv[1] && argv[1][0] == '%') ||
+             strcmp( cmd, "ok-after" ) == 0){
+      do_depend(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "after" ) == 0 || strcmp( cmd, "every" ) == 0){
+      do_schedule(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "timeout" ) == 0){
+      do_timeout(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "kill" ) == 0){
+      do_kill(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "jstat" ) == 0){
+      do_jstat(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "perfstat" ) == 0){
+      do_perfstat(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "alias" ) == 0){
+      do_alias(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "unalias" ) == 0){
+      do_unalias(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "local" ) == 0){
+      do_local(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "return" ) == 0){
+      do_return(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "shift" ) == 0){
+      do_shift(argv);
+      return 1;
+    }
+    else if (strcmp( cmd, "pwd" ) == 0){
+      char *cwd = getcwd(NULL, 0);
+      if (cwd == NULL){
+        perror("pwd");
+        last_status = 1;
+        return 1;
+      }
+      printf("%s\n", cwd);
+      free(cwd);
+      last_status = 0;
+      return 1;
+    }
+return 0;
+
+}
+
+/*
+ * is_builtin - Is name a builtin that runs on its own words? after,
+ *    every, timeout and perfstat don't count: they hand the rest of the
+ *    line, redirections and all, on as a command. Keep in step with
+ *    builtin_cmd.
+ */
+int is_builtin(const char *name) {
+    static const char *names[] = {
+        "quit", "fg", "bg", "jobs", "source", ".", "kill", "jstat", "alias",
+        "unalias", "local", "return", "shift", "pwd", NULL
+    };
+    const char **n;
+
+    for (n = names; *n; n++)
+        if (strcmp(name, *n) == 0)
+            return 1;
+    return 0;
+}
+
+/* 
+ * do_bgfg - Execute the builtin bg and fg commands -SHIREN | TRACE 9
+ */
+void do_bgfg(char **argv) {
+    struct job_t *jobfound;
+    if (!argv[1]) { // Ensure there is an argument
+        printf("%s command requires PID or %%jid argument\n", argv[0]);
+        return;
+    }
+    
+    // Does not have % therefore is JID
+    if(argv[1][0] == '%'){
+        int jid = strtol(&argv[1][1], NULL, 10);
+        // Check for conversion errors
+        if(jid == 0){
+            printf("%s: argument must be a PID or a %%jid\n", argv[0]);
+            return;
+        }
+        jobfound = getjobjid(jobs, jid);
+    }
+    // Has null therfore is PID
+    else{
+        pid_t pid = strtol(argv[1], NULL, 10);
+
+        if(pid == 0){
+            printf("%s: argument must be a PID or a %%jid\n", argv[0]);
+            return;
+        }  
+        jobfound = getjobpid(jobs, pid);
+    }
+    
+    if(jobfound != NULL && jobfound->pid == 0){
+        printf("%s: job %d has not started yet\n", argv[0], jobfound->jid);
+        return;
+    }
+    if(jobfound != NULL){
+        int jidSOLO = jobfound->jid;
+        pid_t pidSOLO = jobfound->pid;
+        if(strcmp(argv[0], "bg") == 0){
+            jobfound->state = BG;
+            
+            printf("[%d] (%d) %s", jidSOLO, pidSOLO, jobfound->cmdline);
+            
+            kill(-pidSOLO, SIGCONT);
+        } 
+        else {
+            jobfound->state = FG;
+            kill(-pidSOLO, SIGCONT);
+            waitfg(jobfound->pid);
+            last_status = fg_status;
+        }
+        
+    }
+    else{
+      if(argv[1][0]== '%'){
+        printf("%s: No such job\n", argv[1]);
+        return;
+      }
+      else{
+        printf("(%s): No such process\n", argv[1]);
+        return;
+      }
+    }
+    return;
+}
+
+/*
+ * do_schedule - Execute the builtin after and every commands:
+ *    after DURATION command [args...]
+ *    every DURATION command [args...]
+ *    The command becomes a scheduled job that launches in the background
+ *    once (after) or every DURATION (every) until killed.
+ */
+void do_schedule(char **argv) {
+    unsigned long ticks;
+    struct job_t *job;
+    char *text;
+    int argc, jid, i;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    if (argc > 0 && !IS_LIT(argv_lit, argc - 1) && strcmp(argv[argc - 1], "&") == 0)
+        argc--;
+    if (argc < 3 || parse_duration(argv[1], &ticks) == -1) {
+        printf("Usage: %s duration command [args...]\n", argv[0]);
+        last_status = 2;
+        return;
+    }
+    if (argv[0][0] == 'e' && ticks == 0) {
+        printf("%s: period must be at least %dms\n", argv[0], TICK_MS);
+        last_status = 2;
+        return;
+    }
+
+    text = join_argv(argv, argc);
+    jid = addjob(jobs, 0, SC, text);
+    free(text);
+    if (!jid) {
+        last_status = 1;
+        return;
+    }
+    job = getjobjid(jobs, jid);
+
+    /* Keep our own copy of the command, to be run with a trailing & */
+    if ((job->argv = malloc(argc * sizeof(char *))) == NULL ||
+        (job->lit = calloc(argc, 1)) == NULL)
+        unix_error("malloc error");
+    for (i = 2; i < argc; i++) {
+        if ((job->argv[i - 2] = strdup(argv[i])) == NULL)
+            unix_error("strdup error");
+        job->lit[i - 2] = IS_LIT(argv_lit, i);
+    }
+    job->argv[argc - 2] = strdup("&");
+    job->argv[argc - 1] = NULL;
+
+    job->timer.kind = argv[0][0] == 'a' ? TM_AFTER : TM_EVERY;
+    job->timer.period = ticks;
+    start_timer(&job->timer, ticks);
+    printf("[%d] %s", jid, job->cmdline);
+    last_status = 0;
+}
+
+/*
+ * do_depend - Execute the builtin after and ok-after commands when they
+ *    are given jobs instead of a duration:
+ *    after %jid... [--] command [args...]
+ *    ok-after %jid... [--] command [args...]
+ *    The command becomes a pending job that launches in the background
+ *    once all the listed jobs have finished (ok-after: with status 0;
+ *    if one fails the command is not run).
+ */
+void do_depend(char **argv) {
+    struct job_t *job;
+    sigset_t old;
+    char *text;
+    int argc, jid, cmd, i;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    if (argc > 0 && !IS_LIT(argv_lit, argc - 1) && strcmp(argv[argc - 1], "&") == 0)
+        argc--;
+    for (cmd = 1; cmd < argc && argv[cmd][0] == '%'; cmd++)
+        ;
+    i = cmd;
+    if (cmd < argc && strcmp(argv[cmd], "--") == 0)
+        cmd++;
+    if (i == 1 || cmd >= argc) {
+        printf("Usage: %s %%jid... -- command [args...]\n", argv[0]);
+        last_status = 2;
+        return;
+    }
+
+    block_sigchld(&old);            /* so none of them finishes unseen */
+    for (i = 1; argv[i][0] == '%'; i++) {
+        if (!getjobjid(jobs, atoi(&argv[i][1]))) {
+            printf("%s: No such job\n", argv[i]);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            last_status = 1;
+            return;
+        }
+    }
+    text = join_argv(argv, argc);
+    jid = addjob(jobs, 0, PD, text);
+    free(text);
+    if (!jid) {
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        last_status = 1;
+        return;
+    }
+    job = getjobjid(jobs, jid);
+
+    if ((job->argv = malloc((argc - cmd + 2) * sizeof(char *))) == NULL ||
+        (job->lit = calloc(argc - cmd + 2, 1)) == NULL)
+        unix_error("malloc error");
+    for (i = cmd; i < argc; i++) {
+        if ((job->argv[i - cmd] = strdup(argv[i])) == NULL)
+            unix_error("strdup error");
+        job->lit[i - cmd] = IS_LIT(argv_lit, i);
+    }
+    job->argv[argc - cmd] = strdup("&");
+    job->argv[argc - cmd + 1] = NULL;
+
+    job->okafter = argv[0][0] == 'o';
+    for (i = 1; argv[i][0] == '%'; i++)
+        ;
+    while (--i > 0) {               /* backwards, so prereqs reads in order */
+        struct job_t *pre = getjobjid(jobs, atoi(&argv[i][1]));
+        add_dep(&pre->dependents, job);
+        add_dep(&job->prereqs, pre);
+        job->waiting++;
+    }
+    printf("[%d] %s", jid, job->cmdline);
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    last_status = 0;
+}
+
+/*
+ * do_timeout - Execute the builtin timeout command:
+ *    timeout [-k GRACE] DURATION command [args...]
+ *    Runs the command (in the background if it ends in &) and sends its
+ *    process group SIGTERM after DURATION, then SIGKILL after GRACE.
+ */
+void do_timeout(char **argv) {
+    unsigned long deadline, grace = (KILL_GRACE + TICK_MS - 1) / TICK_MS;
+    char *text;
+    int argc, i = 1;
+
+    if (argv[i] && strcmp(argv[i], "-k") == 0) {
+        if (!argv[i + 1] || parse_duration(argv[i + 1], &grace) == -1) {
+            printf("timeout: invalid grace period\n");
+            last_status = 2;
+            return;
+        }
+        i += 2;
+    }
+    if (!argv[i] || !argv[i + 1] || parse_duration(argv[i], &deadline) == -1) {
+        printf("Usage: timeout [-k grace] duration command [args...]\n");
+        last_status = 2;
+        return;
+    }
+    i++;
+    for (argc = 0; argv[i + argc]; argc++)
+        ;
+
+    text = join_argv(argv, i + argc);
+    launch_deadline = deadline ? deadline : 1;
+    launch_grace = grace;
+    eval_cmd(text, argc, &argv[i], argv_lit ? argv_lit + i : NULL);
+    launch_deadline = 0;
+    free(text);
+}
+
+/*
+ * do_kill - Execute the builtin kill command:
+ *    kill [-SIGNAL] %jid|pid ...
+ *    Signals the job's process group (SIGTERM by default). Scheduled
+ *    and pending jobs are cancelled instead.
+ */
+void do_kill(char **argv) {
+    static const struct { const char *name; int sig; } signames[] = {
+        {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+        {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"TERM", SIGTERM},
+        {"CONT", SIGCONT}, {"STOP", SIGSTOP}, {"TSTP", SIGTSTP}, {NULL, 0}
+    };
+    struct job_t *job;
+    sigset_t old;
+    int sig = SIGTERM, i = 1, k;
+    char *name;
+    pid_t pid;
+
+    last_status = 0;
+    if (argv[1] && argv[1][0] == '-') {
+        name = argv[1] + 1;
+        if (strncmp(name, "SIG", 3) == 0)
+            name += 3;
+        sig = isdigit((unsigned char)*name) ? atoi(name) : 0;
+        for (k = 0; !sig && signames[k].name; k++)
+            if (strcmp(name, signames[k].name) == 0)
+                sig = signames[k].sig;
+        if (!sig) {
+            printf("kill: %s: invalid signal specification\n", argv[1]);
+            last_status = 2;
+            return;
+        }
+        i++;
+    }
+    if (!argv[i]) {
+        printf("kill command requires PID or %%jid argument\n");
+        last_status = 2;
+        return;
+    }
+
+    for (; argv[i]; i++) {
+        if (argv[i][0] == '%') {
+            job = getjobjid(jobs, atoi(&argv[i][1]));
+            if (!job) {
+                printf("%s: No such job\n", argv[i]);
+                last_status = 1;
+                continue;
+            }
+            if (job->state == SC || job->state == PD) {
+                block_sigchld(&old);
+                job_done(job, 0);   /* as if it had failed */
+                clearjob(job);
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                continue;
+            }
+            pid = -job->pid;
+        }
+        else if ((pid = atoi(argv[i])) <= 0) {
+            printf("kill: argument must be a PID or a %%jid\n");
+            last_status = 2;
+            continue;
+        }
+        else if (getjobpid(jobs, pid)) {
+            pid = -pid;
+        }
+        if (kill(pid, sig) == -1) {
+            printf("(%s): %s\n", argv[i], strerror(errno));
+            last_status = 1;
+        }
+    }
+    launch_ready();
+}
+
+/*
+ * fmt_bytes - Format n bytes as e.g. "512", "12.3K" or "1.5G"
+ */
+static char *fmt_bytes(unsigned long long n, char *buf, size_t size) {
+    static const char units[] = "KMGTP";
+    double v = n;
+    int u = -1;
+
+    if (n < 1024) {
+        snprintf(buf, size, "%llu", n);
+        return buf;
+    }
+    while (v >= 1024 && u < 4) {
+        v /= 1024;
+        u++;
+    }
+    snprintf(buf, size, "%.1f%c", v, units[u]);
+    return buf;
+}
+
+/*
+ * do_jstat - Execute the builtin jstat command:
+ *    jstat [-i interval [-n count]] [%jid|pid ...]
+ *    Prints CPU%, RSS, bytes read and written and thread count for each
+ *    job (or the ones named), summed over its whole process group. With
+ *    -i it samples again every interval until ctrl-c, or count times.
+ */
+void do_jstat(char **argv) {
+    static struct jstat_t stats[MAXJOBS];
+    struct job_t *want[MAXJOBS];
+    struct job_t *job;
+    unsigned long interval = 0;
+    long count = -1;
+    int nwant = 0, i = 1, k;
+    char rss[16], rd[16], wr[16];
+    sigset_t mask, old;
+    struct pollfd pfd = { timer_fd, POLLIN, 0 };
+    struct timespec ts, due;
+
+    for (; argv[i] && argv[i][0] == '-'; i += 2) {
+        if (strcmp(argv[i], "-i") == 0 && argv[i + 1] &&
+            parse_duration(argv[i + 1], &interval) == 0 && interval > 0)
+            continue;
+        if (strcmp(argv[i], "-n") == 0 && argv[i + 1] && (count = atol(argv[i + 1])) > 0)
+            continue;
+        printf("Usage: jstat [-i interval [-n count]] [%%jid|pid ...]\n");
+        last_status = 2;
+        return;
+    }
+    for (; argv[i]; i++) {
+        job = argv[i][0] == '%' ? getjobjid(jobs, atoi(&argv[i][1]))
+                                : getjobpid(jobs, atoi(argv[i]));
+        if (!job) {
+            printf("%s: No such job\n", argv[i]);
+            last_status = 1;
+            return;
+        }
+        for (k = 0; k < nwant && want[k] != job; k++)
+            ;
+        if (k == nwant)         /* each job once, so want can't overflow */
+            want[nwant++] = job;
+    }
+
+    sigemptyset(&mask);
+    last_status = 0;
+    while (1) {
+        /* The next sample is due one interval after this one starts,
+           however often the wait below is woken */
+        clock_gettime(CLOCK_MONOTONIC, &due);
+        due.tv_sec += interval * TICK_MS / 1000;
+        due.tv_nsec += interval * TICK_MS % 1000 * 1000000;
+        if (due.tv_nsec >= 1000000000) {
+            due.tv_sec++;
+            due.tv_nsec -= 1000000000;
+        }
+        sample_jobs(stats);
+        printf("JOB    PID       CPU%%      RSS     READ    WRITE  THR  COMMAND\n");
+        for (k = 0; k < (nwant ? nwant : MAXJOBS); k++) {
+            job = nwant ? want[k] : &jobs[k];
+            if (job->jid == 0 || job->pid == 0)
+                continue;
+            struct jstat_t *st = &stats[job - jobs];
+            printf("[%d]%*s %-7d %6.1f %8s %8s %8s %4d  %s", job->jid,
+                   job->jid < 10 ? 2 : job->jid < 100 ? 1 : 0, "", job->pid,
+                   st->cpu, fmt_bytes(st->rss, rss, sizeof(rss)),
+                   fmt_bytes(st->rchar, rd, sizeof(rd)),
+                   fmt_bytes(st->wchar, wr, sizeof(wr)), st->threads, job->cmdline);
+        }
+        fflush(stdout);
+
+        if (!interval || --count == 0)
+            break;
+        /* Sleep, but keep timers and jobs waiting on others going, and
+           stop on ctrl-c */
+        while (!interrupted) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            ts.tv_sec = due.tv_sec - ts.tv_sec;
+            ts.tv_nsec = due.tv_nsec - ts.tv_nsec;
+            if (ts.tv_nsec < 0) {
+                ts.tv_sec--;
+                ts.tv_nsec += 1000000000;
+            }
+            if (ts.tv_sec < 0)
+                break;
+            block_sigchld(&old);
+            if (ready_jobs)
+                launch_ready();
+            if (perf_done)
+                report_perf();
+            int ready = ppoll(&pfd, 1, &ts, &mask);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            if (ready > 0)
+                run_timers();
+            else if (ready == 0 || errno != EINTR)
+                break;
+        }
+        if (interrupted)
+            break;
+    }
+}
+
+/* 
+ * waitfg - Block until process pid is no longer the foreground process
+ */
+void waitfg(pid_t pid) {
+   // Get the process group of the id passed as well as the foreground process group
+    pid_t pidPG = getpgid(pid);
+    struct job_t *job = getjobpid(jobs, pid);
+    pid_t fgPG = fgpid(jobs);
+
+    // setup an empty mask for ppoll
+    sigset_t mask, old;
+    sigemptyset(&mask);
+    int inForeground = TRUE;
+    struct pollfd pfd = { timer_fd, POLLIN, 0 };
+
+    // If the process is currently in the foreground, suspend until you get a signal.
+    // Timers keep firing while we wait, so timeout can stop this very job.
+    // Once we have a signal, check if the process is still in the foreground.
+    // If it is, loop back and continue blocking, if it isn't kill the loop and return.
+    if(pidPG == fgPG){
+        while(inForeground){
+            // Jobs that were waiting on the ones that just finished start
+            // now, with SIGCHLD held off until ppoll so none slips past
+            block_sigchld(&old);
+            if (ready_jobs){
+                launch_ready();
+            }
+            if (perf_done){
+                report_perf();
+            }
+            if (job->state != FG){
+                sigprocmask(SIG_SETMASK, &old, NULL);
+                break;
+            }
+            int ready = ppoll(&pfd, 1, NULL, &mask);
+            sigprocmask(SIG_SETMASK, &old, NULL);
+            if (ready == -1 && errno != EINTR){
+                perror("ppoll");
+            }
+            if (ready > 0){
+                run_timers();
+            }
+            pidPG = getpgid(pid);
+            if(pidPG != fgPG || job->state != 1){
+                inForeground = FALSE;
+            }
+        }
+    }
+    return;
+
+}
+
+
+/*****************
+ * Signal handlers
+ *****************/
+
+/* 
+ * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
+ *     a child job terminates (becomes a zombie), or stops because it
+ *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
+ *     available zombie children, but doesn't wait for any other
+ *     currently running children to terminate.  
+ */
+void sigchld_handler(int sig) {
+    pid_t reapedPID;
+    int status;
+
+    // Keep going until nothing is left: timers can finish many jobs at once
+    while ((reapedPID = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0){
+        struct job_t *job = getjobpid(jobs, reapedPID);
+        if(job == NULL){
+            continue;
+        }
+        if(WIFSTOPPED(status)){
+            job->state = ST;
+            fg_status = 128 + WSTOPSIG(status);
+            notify("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, SIGTSTP);
+            continue;
+        }
+        if(WIFCONTINUED(status)){
+            continue;
+        }
+        else{
+            // Child was either exited normally or was terminated
+            if(job->state == FG){
+              fg_status = WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+            }
+            if(!WIFEXITED(status)){
+              notify("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
+            }
+            job_done(job, WIFEXITED(status) && WEXITSTATUS(status) == 0);
+            deletejob(jobs, reapedPID);
+        }
+    }
+return;
+}
+
+/* 
+ * sigint_handler - The kernel sends a SIGINT to the shell whenever the
+ *    user types ctrl-c at the keyboard.  Catch it and send it along
+ *    to the foreground job. - KAIRUI | TRACE 6,7
+ */
+void sigint_handler(int sig) {
+    pid_t fgp = fgpid(jobs);
+    interrupted = 1; // stops any running for/while loop
+    if(fgp != 0){
+        // struct job_t *job = getjobpid(jobs, fgp);
+        if(kill(-fgp, sig)==-1){
+            perror("sigint error");
+        }
+    }
+    return;
+}
+
+/*
+ * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
+ *     the user types ctrl-z at the keyboard. Catch it and suspend the
+ *     foreground job by sending it a SIGTSTP. - GAO | TRACE 8
+ */
+void sigtstp_handler(int sig) {
+    pid_t fgp = fgpid(jobs);
+    if(fgp == 0){
+        return;
+    }
+    // struct job_t *job = getjobpid(jobs, fgp);
+    if(kill(-fgp, sig) == -1){
+        perror("sigtstp");
+    }
+    return;
+}
+
+/*
+ * sigusr1_handler - child is ready
+ */
+void sigusr1_handler(int sig) {
+    ready = 1;
+}
+
+
+/*********************
+ * End signal handlers
+ *********************/
+
+/***********************************************
+ * Helper routines that manipulate the job list
+ **********************************************/
+
+/* clearjob - Clear the entries in a job struct */
+void clearjob(struct job_t *job) {
+    int i;
+
+    del_timer(&job->timer);
+    job->timer.kind = TM_NONE;
+    job->timer.job = job;
+    if (job->argv) { /* only scheduled jobs, never cleared by the handler */
+        for (i = 0; job->argv[i]; i++)
+            free(job->argv[i]);
+        free(job->argv);
+        job->argv = NULL;
+        free(job->lit);
+        job->lit = NULL;
+    }
+    free_deps(job->prereqs); /* NULL once launched, so also handler-safe */
+    job->prereqs = NULL;
+    job->waiting = 0;
+    job->okafter = 0;
+    job->failed = 0;
+    job->pid = 0;
+    job->jid = 0;
+    job->state = UNDEF;
+    if (job->cmdline)   /* the buffer stays with the slot */
+        job->cmdline[0] = '\0';
+}
+
+/*
+ * set_cmdline - Copy cmdline into the job, growing its buffer if it
+ *    has to. Not from the handler: only clearjob runs there.
+ */
+void set_cmdline(struct job_t *job, const char *cmdline) {
+    size_t n = strlen(cmdline) + 1;
+
+    if (n > job->cmdcap) {
+        free(job->cmdline);
+        job->cmdcap = n < 64 ? 64 : n;
+        if ((job->cmdline = malloc(job->cmdcap)) == NULL)
+            unix_error("malloc error");
+    }
+    memcpy(job->cmdline, cmdline, n);
+}
+
+/* initjobs - Initialize the job list */
+void initjobs(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        clearjob(&jobs[i]);
+}
+
+/* freejid - Returns smallest free job ID */
+int freejid(struct job_t *jobs) {
+    int i;
+    int taken[MAXJOBS + 1] = {0};
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].jid != 0) 
+        taken[jobs[i].jid] = 1;
+    for (i = 1; i <= MAXJOBS; i++)
+        if (!taken[i])
+            return i;
+    return 0;
+}
+
+/* addjob - Add a job to the job list. Returns its JID, or 0 on failure.
+ *    Only scheduled (SC) and pending (PD) jobs may be added without a PID. */
+int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
+    int i;
+    
+    if (pid < 1 && state != SC && state != PD)
+        return 0;
+    int free = freejid(jobs);
+    if (!free) {
+        printf("Tried to create too many jobs\n");
+        return 0;
+    }
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].jid == 0) {
+            jobs[i].pid = pid;
+            jobs[i].state = state;
+            jobs[i].jid = free;
+            jobs[i].seq = ++jobseq;
+            set_cmdline(&jobs[i], cmdline);
+            if(verbose){
+                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
+            }
+            return free;
+        }
+    }
+    return 0; /*suppress compiler warning*/
+}
+
+/* deletejob - Delete a job whose PID=pid from the job list */
+int deletejob(struct job_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+        return 0;
+
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].pid == pid) {
+            clearjob(&jobs[i]);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* fgpid - Return PID of current foreground job, 0 if no such job */
+pid_t fgpid(struct job_t *jobs) {
+    int i;
+
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].state == FG)
+            return jobs[i].pid;
+    return 0;
+}
+
+/* getjobpid  - Find a job (by PID) on the job list */
+struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
+    int i;
+
+    if (pid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid == pid)
+            return &jobs[i];
+    return NULL;
+}
+
+/* getjobjid  - Find a job (by JID) on the job list */
+struct job_t *getjobjid(struct job_t *jobs, int jid) 
+{
+    int i;
+
+    if (jid < 1)
+        return NULL;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].jid == jid)
+            return &jobs[i];
+    return NULL;
+}
+
+/* pid2jid - Map process ID to job ID */
+int pid2jid(pid_t pid) {
+    int i;
+
+    if (pid < 1)
+        return 0;
+    for (i = 0; i < MAXJOBS; i++)
+        if (jobs[i].pid == pid) {
+            return jobs[i].jid;
+    }
+    return 0;
+}
+
+/* listjobs - Print the job list */
+void listjobs(struct job_t *jobs) {
+    struct dep_t *d;
+    int i;
+    long left;
+    
+    for (i = 0; i < MAXJOBS; i++) {
+        if (jobs[i].jid != 0) {
+            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
+            switch (jobs[i].state) {
+                case BG: 
+                    printf("Running ");
+                    break;
+                case FG: 
+                    printf("Foreground ");
+                    break;
+                case ST: 
+                    printf("Stopped ");
+                    break;
+                case SC:
+                    printf("Scheduled ");
+                    break;
+                case PD:
+                    printf("Waiting (on");
+                    for (d = jobs[i].prereqs; d; d = d->next)
+                        if (d->job->jid && d->job->seq == d->seq)
+                            printf(" %%%d", d->job->jid);
+                    printf(") ");
+                    break;
+                default:
+                    printf("listjobs: Internal error: job[%d].state=%d ", 
+                       i, jobs[i].state);
+            }
+            if (jobs[i].timer.kind != TM_NONE) {
+                left = (long)(jobs[i].timer.expires - ticks_now()) * TICK_MS;
+                if (left < 0)
+                    left = 0;
+                printf("(%s in %ld.%02lds) ",
+                       jobs[i].timer.kind == TM_TERM ? "deadline" :
+                       jobs[i].timer.kind == TM_KILL ? "SIGKILL" : "next",
+                       left / 1000, left % 1000 / 10);
+            }
+            printf("%s", jobs[i].cmdline);
+        }
+    }
+}
+/******************************
+ * end job list helper routines
+ ******************************/
+
+/*****************************************************************
+ * Job dependency graph
+ *
+ * A pending job keeps edges to the jobs it waits on (prereqs) and
+ * each of those keeps edges back to it (dependents). Edges carry the
+ * seq of the job they point at, so a slot that has since been reused
+ * is recognised and ignored. When a job finishes, the SIGCHLD handler
+ * walks its dependents and counts them down, but forking from the
+ * handler isn't safe: jobs that are ready (or have lost a prerequisite
+ * of an ok-after) go on a ready list that launch_ready works off from
+ * the main loop. Everything else runs with SIGCHLD blocked.
+ *****************************************************************/
+
+/* add_dep - Add an edge to job at the front of list */
+void add_dep(struct dep_t **list, struct job_t *job) {
+    struct dep_t *dep;
+
+    if ((dep = malloc(sizeof(*dep))) == NULL)
+        unix_error("malloc error");
+    dep->job = job;
+    dep->seq = job->seq;
+    dep->next = *list;
+    *list = dep;
+}
+
+/* free_deps - Free a list of edges */
+void free_deps(struct dep_t *dep) {
+    struct dep_t *next;
+
+    for (; dep; dep = next) {
+        next = dep->next;
+        free(dep);
+    }
+}
+
+/*
+ * job_done - Tell the jobs waiting on job that it has finished, ok if
+ *    it exited with status 0, and queue its perfstat counters to be
+ *    printed. Only moves pointers around, so it is safe in the SIGCHLD
+ *    handler; the edges are freed later by launch_ready.
+ */
+void job_done(struct job_t *job, int ok) {
+    struct dep_t *dep, *next;
+    struct job_t *waiter;
+
+    if (job->perf) {
+        clock_gettime(CLOCK_MONOTONIC, &job->perf->end);
+        job->perf->next = perf_done;
+        perf_done = job->perf;
+        job->perf = NULL;
+    }
+
+    for (dep = job->dependents; dep; dep = next) {
+        next = dep->next;
+        waiter = dep->job;
+        if (waiter->seq == dep->seq && waiter->state == PD) {
+            if (!ok && waiter->okafter)
+                waiter->failed = 1;
+            if ((--waiter->waiting == 0 || waiter->failed) && !waiter->queued) {
+                waiter->queued = 1;
+                waiter->ready_next = ready_jobs;
+                ready_jobs = waiter;
+            }
+        }
+        dep->next = dead_deps;
+        dead_deps = dep;
+    }
+    job->dependents = NULL;
+}
+
+/*
+ * launch_job - Start a scheduled or pending job's command in the
+ *    background. The process takes over the job's slot, so jobs waiting
+ *    on its JID keep waiting for the command itself. Call with SIGCHLD
+ *    blocked.
+ */
+void launch_job(struct job_t *job) {
+    char **argv = job->argv, *text, *lit = job->lit;
+    int argc, out_fd = -1;
+
+    for (argc = 0; argv[argc]; argc++)
+        ;
+    text = join_argv(argv, argc);
+    job->argv = NULL;
+    job->lit = NULL;
+
+    /* It is nothing to do with a $(...) that happens to be running */
+    if (notice_fd != -1 && notice_fd != STDOUT_FILENO) {
+        fflush(stdout);
+        out_fd = fcntl(STDOUT_FILENO, F_DUPFD_CLOEXEC, 0);
+        dup2(notice_fd, STDOUT_FILENO);
+    }
+    launch_into = job;
+    eval_cmd(text, argc, argv, lit);
+    launch_into = NULL;
+    if (out_fd != -1) {
+        fflush(stdout);
+        dup2(out_fd, STDOUT_FILENO);
+        close(out_fd);
+    }
+    if (job->pid == 0) {            /* a builtin, which has already run */
+        job_done(job, last_status == 0);
+        clearjob(job);
+    }
+    free(text);
+    while (argc--)
+        free(argv[argc]);
+    free(argv);
+    free(lit);
+}
+
+/*
+ * launch_ready - Start the pending jobs whose prerequisites have all
+ *    finished, and cancel the ok-after jobs one of whose failed.
+ */
+void launch_ready(void) {
+    struct job_t *job;
+    struct dep_t *dep;
+    sigset_t old;
+
+    block_sigchld(&old);
+    while ((job = ready_jobs) != NULL) {
+        ready_jobs = job->ready_next;
+        job->queued = 0;
+        if (job->state != PD)       /* killed while on the list */
+            continue;
+        if (job->failed) {
+            notify("[%d] Not run, a prerequisite failed: %s", job->jid, job->cmdline);
+            job_done(job, 0);
+            clearjob(job);
+        }
+        else if (job->waiting == 0) {
+            free_deps(job->prereqs);
+            job->prereqs = NULL;
+            launch_job(job);
+        }
+    }
+    while ((dep = dead_deps) != NULL) {
+        dead_deps = dep->next;
+        free(dep);
+    }
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+
+/*****************************************************************
+ * Timer wheel
+ *
+ * Timers live in TW_LEVELS wheels of TW_SIZE slots. Level 0 holds
+ * timers due within TW_SIZE ticks, one slot per tick; each higher
+ * level covers TW_SIZE times the range of the one below. Whenever
+ * level 0 wraps, the next slot of level 1 is cascaded down into it,
+ * and so on up. Adding, removing and expiring a timer are all O(1)
+ * no matter how many are pending. A single timerfd wakes the shell
+ * for the next busy level 0 slot or the next cascade.
+ *
+ * The SIGCHLD handler removes timers (via clearjob), so everything
+ * else that touches the wheel runs with SIGCHLD blocked.
+ *****************************************************************/
+
+/* ticks_now - Ticks since the shell started */
+unsigned long ticks_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((ts.tv_sec - epoch.tv_sec) * 1000 +
+            (ts.tv_nsec - epoch.tv_nsec) / 1000000) / TICK_MS;
+}
+
+/* block_sigchld - Block SIGCHLD, saving the old mask in old */
+void block_sigchld(sigset_t *old) {
+    sigset_t set;
+
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, old);
+}
+
+/* add_timer - Put t in the slot for its expiry */
+static void add_timer(struct wtimer_t *t) {
+    unsigned long expires = t->expires;
+    unsigned long delta = expires - wheel.now;
+    struct wtimer_t **slot;
+    int level;
+
+    if ((long)delta < 0) {          /* already due: fire on the next tick */
+        slot = &wheel.slot[0][wheel.now & TW_MASK];
     }
-    else if (strcmp( cmd, "bg" ) == 0){
-	  //run bg - SHIREN | TRACE 9
-      do_bgfg(argv);
+    else {
+        /* Too far out for the top level: park it in the last slot
+         * and let the cascade re-file it later */
+        if (delta >= 1UL << (TW_BITS * TW_LEVELS))
+            expires = wheel.now + (1UL << (TW_BITS * TW_LEVELS)) - 1;
+        for (level = 0; level < TW_LEVELS - 1; level++)
+            if (expires - wheel.now < 1UL << (TW_BITS * (level + 1)))
+                break;
+        slot = &wheel.slot[level][(expires >> (TW_BITS * level)) & TW_MASK];
     }
-    else if (strcmp( cmd, "jobs" ) == 0){
-	  //run jobs - SHIREN | TRACE 5
-      listjobs(jobs);
-      return 0;
+
+    t->next = *slot;
+    if (t->next)
+        t->next->pprev = &t->next;
+    t->pprev = slot;
+    *slot = t;
+    wheel.count++;
+}
+
+/* del_timer - Take t off the wheel if it is on it */
+void del_timer(struct wtimer_t *t) {
+    if (!t->pprev)
+        return;
+    *t->pprev = t->next;
+    if (t->next)
+        t->next->pprev = t->pprev;
+    t->next = NULL;
+    t->pprev = NULL;
+    wheel.count--;
+}
+
+/* arm_timerfd - Set the timerfd for the next tick that needs looking at */
+static void arm_timerfd(void) {
+    struct itimerspec its;
+    unsigned long next, ms;
+    int i;
+
+    memset(&its, 0, sizeof(its));
+    if (wheel.count > 0) {
+        next = (wheel.now | TW_MASK) + 1;   /* next cascade */
+        for (i = wheel.now & TW_MASK; i < TW_SIZE; i++) {
+            if (wheel.slot[0][i]) {
+                next = (wheel.now & ~(unsigned long)TW_MASK) + i;
+                break;
+            }
+        }
+        ms = next * TICK_MS;
+        its.it_value.tv_sec = epoch.tv_sec + ms / 1000;
+        its.it_value.tv_nsec = epoch.tv_nsec + (ms % 1000) * 1000000;
+        if (its.it_value.tv_nsec >= 1000000000) {
+            its.it_value.tv_sec++;
+            its.it_value.tv_nsec -= 1000000000;
+        }
     }
-return 0;
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+        unix_error("timerfd_settime error");
+}
+
+/*
+ * start_timer - Fire t delay ticks from now. t->kind and t->period must
+ *    already be set.
+ */
+void start_timer(struct wtimer_t *t, unsigned long delay) {
+    sigset_t old;
 
+    block_sigchld(&old);
+    del_timer(t);
+    if (wheel.count == 0)           /* idle wheel: skip the dead ticks */
+        wheel.now = ticks_now();
+    t->expires = ticks_now() + delay;
+    add_timer(t);
+    arm_timerfd();
+    sigprocmask(SIG_SETMASK, &old, NULL);
 }
 
-/* 
- * do_bgfg - Execute the builtin bg and fg commands -SHIREN | TRACE 9
+/* cascade - Re-file every timer in a slot of a higher level */
+static int cascade(int level, int index) {
+    struct wtimer_t *t = wheel.slot[level][index], *next;
+
+    wheel.slot[level][index] = NULL;
+    for (; t; t = next) {
+        next = t->next;
+        t->pprev = NULL;
+        wheel.count--;
+        add_timer(t);
+    }
+    return index;
+}
+
+#define TW_INDEX(n) ((wheel.now >> (TW_BITS * ((n) + 1))) & TW_MASK)
+
+/* fire - Act on an expired timer */
+static void fire(struct wtimer_t *t) {
+    struct job_t *job = t->job;
+    char **argv, *text;
+    int argc;
+
+    switch (t->kind) {
+        case TM_AFTER:
+            t->kind = TM_NONE;
+            launch_job(job);
+            break;
+        case TM_EVERY:
+            argv = job->argv;
+            for (argc = 0; argv[argc]; argc++)
+                ;
+            text = join_argv(argv, argc);
+            t->expires += t->period;
+            if ((long)(t->expires - wheel.now) < 0)  /* skip missed runs */
+                t->expires = wheel.now + t->period;
+            add_timer(t);
+            eval_cmd(text, argc, argv, job->lit);
+            free(text);
+            break;
+        case TM_TERM:
+            if (job->pid > 0)
+                kill(-job->pid, SIGTERM);
+            t->kind = TM_KILL;
+            t->expires = wheel.now + t->period;
+            add_timer(t);
+            break;
+        case TM_KILL:
+            if (job->pid > 0)
+                kill(-job->pid, SIGKILL);
+            t->kind = TM_NONE;
+            break;
+    }
+}
+
+/*
+ * run_timers - Called when the timerfd is readable. Process every tick
+ *    up to now, firing the timers in each level 0 slot.
  */
-void do_bgfg(char **argv) {
-    struct job_t *jobfound;
-    if (!argv[1]) { // Ensure there is an argument
-        printf("%s command requires PID or %%jid argument\n", argv[0]);
+void run_timers(void) {
+    uint64_t expirations;
+    unsigned long now = ticks_now();
+    struct wtimer_t *t, *next;
+    sigset_t old;
+    int index;
+
+    if (read(timer_fd, &expirations, sizeof(expirations)) == -1 && errno != EAGAIN)
+        unix_error("timerfd read error");
+
+    block_sigchld(&old);
+    while (wheel.count > 0 && (long)(now - wheel.now) >= 0) {
+        index = wheel.now & TW_MASK;
+        if (!index && !cascade(1, TW_INDEX(0)) && !cascade(2, TW_INDEX(1)))
+            cascade(3, TW_INDEX(2));
+        wheel.now++;
+
+        t = wheel.slot[0][index];
+        wheel.slot[0][index] = NULL;
+        for (; t; t = next) {
+            next = t->next;
+            t->next = NULL;
+            t->pprev = NULL;
+            wheel.count--;
+            if ((long)(t->expires - wheel.now) >= 0)
+                add_timer(t);   /* parked far out, not due yet */
+            else
+                fire(t);
+        }
+    }
+    arm_timerfd();
+    sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+/*
+ * arm_deadline - Called by eval_cmd with signals blocked once a job is on
+ *    the list. If the job is being run by timeout, start its deadline.
+ */
+void arm_deadline(pid_t pid) {
+    struct job_t *job = getjobpid(jobs, pid);
+
+    if (!launch_deadline || !job)
         return;
+    job->timer.kind = TM_TERM;
+    job->timer.period = launch_grace;
+    start_timer(&job->timer, launch_deadline);
+    launch_deadline = 0;
+}
+
+/*
+ * parse_duration - Parse "1.5s", "500ms", "5m", "2h" or "1d" (a bare
+ *    number is seconds) into ticks. Returns 0 on success, -1 if invalid.
+ */
+int parse_duration(const char *str, unsigned long *ticks) {
+    char *end;
+    double n = strtod(str, &end);
+    double ms;
+
+    if (end == str || n < 0)
+        return -1;
+    if (*end == '\0' || strcmp(end, "s") == 0)
+        ms = n * 1000;
+    else if (strcmp(end, "ms") == 0)
+        ms = n;
+    else if (strcmp(end, "m") == 0)
+        ms = n * 60 * 1000;
+    else if (strcmp(end, "h") == 0)
+        ms = n * 3600 * 1000;
+    else if (strcmp(end, "d") == 0)
+        ms = n * 86400 * 1000;
+    else
+        return -1;
+    *ticks = (unsigned long)((ms + TICK_MS - 1) / TICK_MS);
+    return 0;
+}
+
+
+/******************
+ * Job statistics
+ *
+ * jstat finds the processes of each job's group by scanning /proc and
+ * keeps /proc/<pid>/{stat,statm,io} open for the ones it cares about,
+ * so a sample costs a readdir plus three preads per process. Processes
+ * outside every job are remembered too, but with no files open, so
+ * they aren't looked at again until their PID goes away.
+ ******************/
+
+/* proc_close - Close an entry's /proc files */
+static void proc_close(struct proc_t *pr) {
+    if (pr->stat_fd != -1) {
+        close(pr->stat_fd);
+        close(pr->statm_fd);
+        close(pr->io_fd);
     }
-    
-    // Does not have % therefore is JID
-    if(argv[1][0] == '%'){
-        int jid = strtol(&argv[1][1], NULL, 10);
-        // Check for conversion errors
-        if(jid == 0){
-            printf("%s: argument must be a PID or a %%jid\n", argv[0]);
-            return;
+    pr->stat_fd = pr->statm_fd = pr->io_fd = -1;
+    pr->job = NULL;
+}
+
+/* proc_open - Open /proc/<pid>/name read only, close on exec */
+static int proc_open(pid_t pid, const char *name) {
+    char path[64];
+
+    snprintf(path, sizeof(path), "/proc/%d/%s", (int)pid, name);
+    return open(path, O_RDONLY | O_CLOEXEC);
+}
+
+/* proc_read - pread a whole /proc file into buf; -1 if the process is gone */
+static int proc_read(int fd, char *buf, size_t size) {
+    ssize_t n = pread(fd, buf, size - 1, 0);
+
+    if (n <= 0)
+        return -1;
+    buf[n] = '\0';
+    return 0;
+}
+
+/* read_stat - Parse pgrp, utime + stime, threads and starttime from stat */
+static int read_stat(int fd, pid_t *pgrp, unsigned long long *cpu,
+                     int *threads, unsigned long long *start) {
+    char buf[1024], *p;
+    unsigned long long utime, stime;
+    int pg;
+
+    /* The command name may hold anything, so skip past the last ')' */
+    if (proc_read(fd, buf, sizeof(buf)) == -1 || !(p = strrchr(buf, ')')))
+        return -1;
+    if (sscanf(p + 2, "%*c %*d %d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu "
+               "%*d %*d %*d %*d %d %*d %llu", &pg, &utime, &stime, threads, start) != 5)
+        return -1;
+    *pgrp = pg;
+    *cpu = utime + stime;
+    return 0;
+}
+
+/* proc_job - The job whose process group pgrp is, if any */
+static struct job_t *proc_job(pid_t pgrp) {
+    struct job_t *job = getjobpid(jobs, pgrp);
+
+    return job && job->state != SC ? job : NULL;
+}
+
+/*
+ * sample_jobs - Fill stats, indexed like jobs[], with one sample of each
+ *    job's processes. CPU% is over the time since the previous sample of
+ *    each process, or its lifetime when it is new.
+ */
+void sample_jobs(struct jstat_t *stats) {
+    static unsigned gen;
+    static long hz, pagesize;
+    struct proc_t *pr, **pp;
+    struct dirent *de;
+    struct timespec ts;
+    struct jstat_t *st;
+    unsigned long long now, cpu, start;
+    char buf[512], *end;
+    long resident;
+    pid_t pid, pgrp;
+    int threads, h;
+    DIR *dir;
+
+    if (!hz) {
+        struct rlimit rl;
+
+        hz = sysconf(_SC_CLK_TCK);
+        pagesize = sysconf(_SC_PAGESIZE);
+        /* Three files per process adds up; use all we are allowed.
+           Jobs put the old limit back, since it is inherited */
+        if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+            nofile_limit = rl;
+            rl.rlim_cur = rl.rlim_max;
+            nofile_raised = setrlimit(RLIMIT_NOFILE, &rl) == 0;
         }
-        jobfound = getjobjid(jobs, jid);
     }
-    // Has null therfore is PID
-    else{
-        pid_t pid = strtol(argv[1], NULL, 10);
+    memset(stats, 0, MAXJOBS * sizeof(struct jstat_t));
+    clock_gettime(CLOCK_BOOTTIME, &ts);
+    now = ts.tv_sec * hz + ts.tv_nsec / (1000000000 / hz);
 
-        if(pid == 0){
-            printf("%s: argument must be a PID or a %%jid\n", argv[0]);
-            return;
-        }  
-        jobfound = getjobpid(jobs, pid);
+    /* Note every process, adding the ones we haven't seen before */
+    gen++;
+    if ((dir = opendir("/proc")) == NULL)
+        return;
+    while ((de = readdir(dir)) != NULL) {
+        pid = strtol(de->d_name, &end, 10);
+        if (pid <= 0 || *end)
+            continue;
+        h = pid % PROCHASH;
+        for (pr = proctab[h]; pr; pr = pr->next)
+            if (pr->pid == pid)
+                break;
+        if (!pr) {
+            if ((pr = calloc(1, sizeof(struct proc_t))) == NULL)
+                unix_error("calloc error");
+            pr->pid = pid;
+            pr->stat_fd = pr->statm_fd = pr->io_fd = -1;
+            pr->next = proctab[h];
+            proctab[h] = pr;
+            if ((pr->stat_fd = proc_open(pid, "stat")) != -1 &&
+                read_stat(pr->stat_fd, &pgrp, &pr->cpu, &threads, &start) == 0 &&
+                (pr->job = proc_job(pgrp)) != NULL) {
+                pr->statm_fd = proc_open(pid, "statm");
+                pr->io_fd = proc_open(pid, "io");
+                pr->cpu = 0;        /* first sample: CPU% over its lifetime */
+                pr->when = start;
+            }
+            else {
+                if (pr->stat_fd != -1)
+                    close(pr->stat_fd);
+                pr->stat_fd = -1;
+                pr->job = NULL;
+            }
+        }
+        pr->gen = gen;
     }
-    
-    if(jobfound != NULL){
-        int jidSOLO = jobfound->jid;
-        pid_t pidSOLO = jobfound->pid;
-        if(strcmp(argv[0], "bg") == 0){
-            jobfound->state = BG;
-            
-            printf("[%d] (%d) %s", jidSOLO, pidSOLO, jobfound->cmdline);
-            
-            kill(-pidSOLO, SIGCONT);
-        } 
-        else {
-            jobfound->state = FG;
-            kill(-pidSOLO, SIGCONT);
-            waitfg(jobfound->pid);
+    closedir(dir);
+
+    /* Forget the dead, sample the living */
+    for (h = 0; h < PROCHASH; h++) {
+        for (pp = &proctab[h]; (pr = *pp) != NULL; ) {
+            if (pr->gen != gen) {
+                *pp = pr->next;
+                proc_close(pr);
+                free(pr);
+                continue;
+            }
+            pp = &pr->next;
+            if (!pr->job)
+                continue;
+            if (read_stat(pr->stat_fd, &pgrp, &cpu, &threads, &start) == -1 ||
+                pr->job->pid != pgrp || pr->job->jid == 0) {
+                proc_close(pr);     /* gone, left the group or job ended */
+                continue;
+            }
+            st = &stats[pr->job - jobs];
+            if (now > pr->when) {   /* else too soon to tell, keep the last */
+                pr->pct = 100.0 * (cpu - pr->cpu) / (now - pr->when);
+                pr->cpu = cpu;
+                pr->when = now;
+            }
+            st->cpu += pr->pct;
+            st->threads += threads;
+            if (pr->statm_fd != -1 && proc_read(pr->statm_fd, buf, sizeof(buf)) == 0 &&
+                sscanf(buf, "%*d %ld", &resident) == 1)
+                st->rss += (unsigned long long)resident * pagesize;
+            if (pr->io_fd != -1 && proc_read(pr->io_fd, buf, sizeof(buf)) == 0) {
+                unsigned long long rchar, wchar;
+                if (sscanf(buf, "rchar: %llu wchar: %llu", &rchar, &wchar) == 2) {
+                    st->rchar += rchar;
+                    st->wchar += wchar;
+                }
+            }
         }
-        
     }
-    else{
-      if(argv[1][0]== '%'){
-        printf("%s: No such job\n", argv[1]);
+}
+
+/*****************************************************************
+ * Performance counters
+ *
+ * perfstat attaches two perf_event_open groups to each thread it
+ * counts: the software events, led by task-clock, and the hardware
+ * ones, led by cycles. Each group is read in one go, so its values
+ * cover the same stretch of time. The counters are inherited, so the
+ * stages of a pipeline and anything else the job forks after that
+ * point are counted too. The kernel folds a child's counts into its
+ * parent's when the child exits, and every stage has exited by the
+ * time the job is reaped. If there is no PMU (in a VM, say) the
+ * hardware group fails to open and only the software events are
+ * reported.
+ *****************************************************************/
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+    const char *name;
+} perf_events[PERF_NEVENTS] = {     /* the first PERF_NSW are software */
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK,       "task-clock"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES, "context-switches"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CPU_MIGRATIONS,   "cpu-migrations"},
+    {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS,      "page-faults"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES,       "cycles"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS,     "instructions"},
+    {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES,     "cache-misses"},
+};
+
+/* perf_open - Open event on thread tid, in the group led by group (or -1) */
+static int perf_open(int event, pid_t tid, int group) {
+    struct perf_event_attr attr;
+    int fd;
+
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = perf_events[event].type;
+    attr.config = perf_events[event].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    attr.inherit = 1;
+    attr.exclude_hv = 1;
+    fd = syscall(SYS_perf_event_open, &attr, tid, -1, group, PERF_FLAG_FD_CLOEXEC);
+    if (fd == -1 && (errno == EACCES || errno == EPERM)) {
+        attr.exclude_kernel = 1;    /* perf_event_paranoid 2: user space only */
+        fd = syscall(SYS_perf_event_open, &attr, tid, -1, group, PERF_FLAG_FD_CLOEXEC);
+    }
+    return fd;
+}
+
+/* perf_new - Start an empty set of counters for the job jid */
+struct perf_t *perf_new(int jid, const char *cmdline) {
+    struct perf_t *perf = calloc(1, sizeof(*perf));
+    size_t len = strcspn(cmdline, "\n");
+
+    if (!perf || !(perf->cmdline = strndup(cmdline, len)))
+        unix_error("malloc error");
+    perf->jid = jid;
+    clock_gettime(CLOCK_MONOTONIC, &perf->start);
+    return perf;
+}
+
+/*
+ * perf_attach - Open both groups on thread tid. Returns -1, with errno
+ *    set, if not even task-clock can be counted.
+ */
+int perf_attach(struct perf_t *perf, pid_t tid) {
+    int *fd, i, lead;
+
+    if (!(perf->fd = realloc(perf->fd, (perf->ntasks + 1) * sizeof(*perf->fd))))
+        unix_error("realloc error");
+    fd = perf->fd[perf->ntasks];
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        lead = i < PERF_NSW ? 0 : PERF_NSW;
+        if (i == lead)
+            fd[i] = perf_open(i, tid, -1);
+        else
+            fd[i] = fd[lead] == -1 ? -1 : perf_open(i, tid, fd[lead]);
+        if (i == 0 && fd[0] == -1)
+            return -1;
+    }
+    perf->ntasks++;
+    return 0;
+}
+
+/* perf_free - Close a job's counters and free them */
+void perf_free(struct perf_t *perf) {
+    int t, i;
+
+    for (t = 0; t < perf->ntasks; t++)
+        for (i = 0; i < PERF_NEVENTS; i++)
+            if (perf->fd[t][i] != -1)
+                close(perf->fd[t][i]);
+    free(perf->fd);
+    free(perf->cmdline);
+    free(perf);
+}
+
+/*
+ * perf_read - Read the group that starts at event lead and runs up to
+ *    event end from one thread's fds, adding each value to sum. Values
+ *    of a group the kernel only ran part of the time (because it had
+ *    to share the PMU) are scaled up to the whole time.
+ */
+static void perf_read(int *fd, int lead, int end, double *sum,
+                      int *counted, int *scaled) {
+    uint64_t buf[3 + PERF_NEVENTS]; /* nr, time enabled, time running, values */
+    double v;
+    int i, k = 3;
+
+    if (fd[lead] == -1 || read(fd[lead], buf, sizeof(buf)) < (ssize_t)(3 * sizeof(uint64_t)))
         return;
-      }
-      else{
-        printf("(%s): No such process\n", argv[1]);
+    for (i = lead; i < end; i++) {
+        if (fd[i] == -1)            /* not in the group */
+            continue;
+        v = buf[k++];
+        if (buf[2] == 0)            /* never got on the PMU */
+            continue;
+        if (buf[2] < buf[1]) {
+            v = v * buf[1] / buf[2];
+            scaled[i] = 1;
+        }
+        sum[i] += v;
+        counted[i] = 1;
+    }
+}
+
+/* perf_print - Print the totals of a job's counters */
+void perf_print(struct perf_t *perf) {
+    double sum[PERF_NEVENTS] = {0}, elapsed;
+    int counted[PERF_NEVENTS] = {0}, scaled[PERF_NEVENTS] = {0};
+    int opened[PERF_NEVENTS] = {0};
+    char num[32], note[64];
+    int t, i;
+
+    for (t = 0; t < perf->ntasks; t++) {
+        perf_read(perf->fd[t], 0, PERF_NSW, sum, counted, scaled);
+        perf_read(perf->fd[t], PERF_NSW, PERF_NEVENTS, sum, counted, scaled);
+        for (i = 0; i < PERF_NEVENTS; i++)
+            opened[i] |= perf->fd[t][i] != -1;
+    }
+    if (perf->end.tv_sec == 0 && perf->end.tv_nsec == 0)
+        clock_gettime(CLOCK_MONOTONIC, &perf->end);
+    elapsed = (perf->end.tv_sec - perf->start.tv_sec) +
+              (perf->end.tv_nsec - perf->start.tv_nsec) / 1e9;
+
+    printf("Performance counters for [%d] %s:\n", perf->jid, perf->cmdline);
+    for (i = 0; i < PERF_NEVENTS; i++) {
+        note[0] = '\0';
+        if (!counted[i]) {
+            printf("%19s %s\n", opened[i] ? "<not counted>" : "<not supported>",
+                   perf_events[i].name);
+            continue;
+        }
+        if (i == 0 && elapsed > 0)
+            snprintf(note, sizeof(note), "%.2f CPUs utilized", sum[0] / 1e9 / elapsed);
+        else if (i == PERF_NSW + 1 && counted[PERF_NSW] && sum[PERF_NSW] > 0)
+            snprintf(note, sizeof(note), "%.2f insn per cycle", sum[i] / sum[PERF_NSW]);
+        else if (i == PERF_NSW + 2 && counted[i - 1] && sum[i - 1] > 0)
+            snprintf(note, sizeof(note), "%.2f per 1k instructions", 1000 * sum[i] / sum[i - 1]);
+        if (scaled[i])
+            strncat(note, *note ? " (scaled)" : "scaled", sizeof(note) - strlen(note) - 1);
+        if (i == 0)
+            snprintf(num, sizeof(num), "%.2f msec", sum[0] / 1e6);
+        else
+            snprintf(num, sizeof(num), "%.0f     ", sum[i]);
+        if (*note)
+            printf("%19s %-17s # %s\n", num, perf_events[i].name, note);
+        else
+            printf("%19s %s\n", num, perf_events[i].name);
+    }
+    printf("%14.6f seconds elapsed\n", elapsed);
+}
+
+/*
+ * report_perf - Print and free the counters of the jobs that have been
+ *    reaped since the last call. Not while $(...) has stdout: they wait
+ *    for the next call after it.
+ */
+void report_perf(void) {
+    struct perf_t *perf;
+    sigset_t old;
+
+    if (notice_fd != -1)
         return;
-      }
+    block_sigchld(&old);
+    while ((perf = perf_done) != NULL) {
+        perf_done = perf->next;
+        perf_print(perf);
+        perf_free(perf);
     }
-    return;
+    sigprocmask(SIG_SETMASK, &old, NULL);
+    fflush(stdout);
 }
 
-/* 
- * waitfg - Block until process pid is no longer the foreground process
+/*
+ * perf_job - Count the threads of a running job from now on, by finding
+ *    the processes in its group in /proc. Call with SIGCHLD blocked.
  */
-void waitfg(pid_t pid) {
-   // Get the process group of the id passed as well as the foreground process group
-    pid_t pidPG = getpgid(pid);
-    struct job_t *job = getjobpid(jobs, pid);
-    pid_t fgPG = fgpid(jobs);
+static void perf_job(struct job_t *job) {
+    struct perf_t *perf = perf_new(job->jid, job->cmdline);
+    struct dirent *de, *te;
+    unsigned long long cpu, start;
+    char path[64];
+    DIR *dir, *tasks;
+    pid_t pid, pgrp;
+    int fd, threads, err = ESRCH;
 
-    // setup an empty mask for sigsuspend
-    sigset_t mask;
-    sigemptyset(&mask);
-    int inForeground = TRUE;
+    if (!(dir = opendir("/proc")))
+        unix_error("opendir error");
+    while ((de = readdir(dir)) != NULL) {
+        if ((pid = atoi(de->d_name)) <= 0 || (fd = proc_open(pid, "stat")) == -1)
+            continue;
+        if (read_stat(fd, &pgrp, &cpu, &threads, &start) == 0 && pgrp == job->pid) {
+            snprintf(path, sizeof(path), "/proc/%d/task", (int)pid);
+            if ((tasks = opendir(path)) != NULL) {
+                while ((te = readdir(tasks)) != NULL)
+                    if (atoi(te->d_name) > 0 && perf_attach(perf, atoi(te->d_name)) == -1)
+                        err = errno;
+                closedir(tasks);
+            }
+        }
+        close(fd);
+    }
+    closedir(dir);
 
-    // If the process is currently in the foreground, suspend until you get a signal.
-    // Once we have a signal, check if the process is still in the foreground.
-    // If it is, loop back and continue blocking, if it isn't kill the loop and return.
-    if(pidPG == fgPG){
-        while(inForeground){
-            if (sigsuspend(&mask) == -1 && errno != EINTR){
-                perror("sigsuspend");
+    if (perf->ntasks == 0) {
+        printf("perfstat: %%%d: %s\n", job->jid, strerror(err));
+        perf_free(perf);
+        last_status = 1;
+        return;
+    }
+    job->perf = perf;
+    printf("[%d] (%d) counting %d thread%s\n", job->jid, job->pid,
+           perf->ntasks, perf->ntasks == 1 ? "" : "s");
+    last_status = 0;
+}
+
+/*
+ * do_perfstat - Execute the builtin perfstat command:
+ *    perfstat command [args...] [&]
+ *    perfstat %jid
+ *    Counts CPU time, context switches, CPU migrations and page faults,
+ *    plus cycles, instructions and cache misses where the hardware
+ *    allows, for a new job or from now on for a running one. The totals
+ *    for the whole job are printed when it is reaped.
+ */
+void do_perfstat(char **argv) {
+    struct job_t *job;
+    sigset_t old;
+    char *text;
+    int argc;
+
+    if (!argv[1]) {
+        printf("Usage: perfstat command [args...] | perfstat %%jid\n");
+        last_status = 2;
+        return;
+    }
+    if (argv[1][0] == '%') {
+        block_sigchld(&old);
+        job = getjobjid(jobs, atoi(&argv[1][1]));
+        if (!job) {
+            printf("%s: No such job\n", argv[1]);
+            last_status = 1;
+        }
+        else if (job->pid == 0) {
+            printf("%s: Not started yet\n", argv[1]);
+            last_status = 1;
+        }
+        else if (job->perf) {
+            printf("%s: Already being counted\n", argv[1]);
+            last_status = 1;
+        }
+        else
+            perf_job(job);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        return;
+    }
+
+    for (argc = 1; argv[argc]; argc++)
+        ;
+    text = join_argv(&argv[1], argc - 1);
+    launch_perf = 1;
+    eval_cmd(text, argc - 1, &argv[1], argv_lit ? argv_lit + 1 : NULL);
+    launch_perf = 0;
+    free(text);
+}
+
+/*****************************************************************
+ * Startup snapshot
+ *
+ * tsh --snapshot FILE runs the rc file and writes the state it leaves
+ * behind, the variable table, the parsed scripts in the source cache
+ * and the functions and aliases, into an image for a fixed address.
+ * A shell started with TSH_SNAPSHOT=FILE maps the image privately
+ * instead of running the rc file, and uses it in place: variables are
+ * looked up in it, and functions, aliases and cached scripts run
+ * straight from its trees. Nothing is copied out; redefining one just
+ * leaves the old tree unused. The image is ignored if the rc file, a
+ * script it sourced or the tsh binary has changed since it was
+ * written, or if its address is taken. Only state is kept: jobs or timers that the
+ * rc file starts are not.
+ *****************************************************************/
+
+/* rc_path - The rc file: $TSHRC, else ~/.tshrc; NULL if neither */
+char *rc_path(void) {
+    static char *path;
+    char *home;
+
+    if (path)
+        return path;
+    if ((path = getenv("TSHRC")) != NULL && *path)
+        return path;
+    if ((home = getenv("HOME")) == NULL)
+        return path = NULL;
+    if ((path = malloc(strlen(home) + sizeof("/.tshrc"))) == NULL)
+        unix_error("malloc error");
+    sprintf(path, "%s/.tshrc", home);
+    return path;
+}
+
+/* snap_identify - Fill in the identity of a file; -1 if it is missing */
+static int snap_identify(const char *path, struct snap_file *id) {
+    struct stat st;
+
+    memset(id, 0, sizeof(*id));
+    if (!path || stat(path, &st) == -1)
+        return -1;
+    id->dev = st.st_dev;
+    id->ino = st.st_ino;
+    id->size = st.st_size;
+    id->sec = st.st_mtim.tv_sec;
+    id->nsec = st.st_mtim.tv_nsec;
+    return 0;
+}
+
+/* snap_put - Append n bytes, 8-byte aligned, to the image; their offset */
+static uint32_t snap_put(struct strbuf_t *img, const void *data, size_t n) {
+    uint32_t off;
+
+    while (img->len % 8)
+        sb_putc(img, '\0');
+    off = img->len;
+    sb_putn(img, data, n);
+    return off;
+}
+
+/* snap_str - Append a string to the image; its offset */
+static uint32_t snap_str(struct strbuf_t *img, const char *str) {
+    uint32_t off = img->len;
+
+    sb_putn(img, str, strlen(str) + 1);
+    return off;
+}
+
+/* snap_ptr - Where offset off of the image will be, or NULL for 0 */
+static void *snap_ptr(uint32_t off) {
+    return off ? (void *)(SNAP_BASE + off) : NULL;
+}
+
+/*
+ * snap_nodes - Append a node list and everything under it, laid out
+ *    to run from SNAP_BASE; its offset
+ */
+static uint32_t snap_nodes(struct strbuf_t *img, const struct node_t *node) {
+    struct node_t n;
+    uint32_t first = 0, prev = 0, off;
+    char **argv;
+    int i;
+
+    for (; node; node = node->next) {
+        memset(&n, 0, sizeof(n));
+        n.type = node->type;
+        n.cond = snap_ptr(snap_nodes(img, node->cond));
+        n.body = snap_ptr(snap_nodes(img, node->body));
+        n.alt = snap_ptr(snap_nodes(img, node->alt));
+        n.cmd.argc = node->cmd.argc;
+        n.cmd.expand = node->cmd.expand;
+        if (node->cmd.text)
+            n.cmd.text = snap_ptr(snap_str(img, node->cmd.text));
+        if (node->cmd.argc) {
+            if ((argv = calloc(node->cmd.argc + 1, sizeof(char *))) == NULL)
+                unix_error("malloc error");
+            for (i = 0; i < node->cmd.argc; i++)
+                argv[i] = snap_ptr(snap_str(img, node->cmd.argv[i]));
+            n.cmd.argv = snap_ptr(snap_put(img, argv, (node->cmd.argc + 1) * sizeof(char *)));
+            n.cmd.lit = snap_ptr(snap_put(img, node->cmd.lit, node->cmd.argc));
+            free(argv);
+        }
+        off = snap_put(img, &n, sizeof(n));
+        if (prev)                       /* link up the one before */
+            ((struct node_t *)(img->s + prev))->next = snap_ptr(off);
+        else
+            first = off;
+        prev = off;
+    }
+    return first;
+}
+
+/*
+ * write_snapshot - Save the variables, the source cache, functions and
+ *    aliases as they are now, tied to the rc file and this binary. Written to a temporary
+ *    file and renamed, so a shell starting meanwhile never sees half an
+ *    image.
+ */
+void write_snapshot(const char *path, const char *rc) {
+    struct strbuf_t img = {0};
+    struct snap_hdr hdr;
+    struct snap_var sv;
+    struct snap_script ss;
+    struct script_t *sc;
+    struct var_t *v;
+    char *tmp;
+    uint32_t off, *list;
+    struct def_t **tab, *def;
+    struct snap_def sd;
+    size_t done;
+    ssize_t n;
+    int i, fd;
+
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, SNAP_MAGIC, sizeof(hdr.magic));
+    hdr.varhash = VARHASH;
+    snap_identify(rc, &hdr.rc);
+    snap_identify("/proc/self/exe", &hdr.exe);
+    snap_put(&img, &hdr, sizeof(hdr));  /* filled in at the end */
+
+    hdr.rcpath = snap_str(&img, rc);
+    for (i = 0; i < VARHASH; i++) {
+        for (v = vartab[i]; v; v = v->next) {
+            sv.name = snap_str(&img, v->name);
+            sv.value = snap_str(&img, v->value);
+            sv.next = hdr.vars[i];
+            hdr.vars[i] = snap_put(&img, &sv, sizeof(sv));
+        }
+    }
+    for (sc = scripts; sc; sc = sc->next) {
+        if (!sc->ast)
+            continue;
+        memset(&ss, 0, sizeof(ss));
+        ss.path = snap_str(&img, sc->path);
+        ss.ast = snap_nodes(&img, sc->ast);
+        ss.sec = sc->mtime.tv_sec;
+        ss.nsec = sc->mtime.tv_nsec;
+        ss.size = sc->size;
+        ss.next = hdr.scripts;
+        off = snap_put(&img, &ss, sizeof(ss));
+        hdr.scripts = off;
+    }
+    for (tab = functab, list = &hdr.funcs; tab; tab = tab == functab ? aliastab : NULL) {
+        for (i = 0; i < VARHASH; i++) {
+            for (def = tab[i]; def; def = def->next) {
+                memset(&sd, 0, sizeof(sd));
+                sd.name = snap_str(&img, def->name);
+                if (def->text)
+                    sd.text = snap_str(&img, def->text);
+                sd.ast = snap_nodes(&img, def->ast);
+                sd.next = *list;
+                *list = snap_put(&img, &sd, sizeof(sd));
             }
-            pidPG = getpgid(pid);
-            if(pidPG != fgPG || job->state != 1){
-                inForeground = FALSE;
+        }
+        list = &hdr.aliases;
+    }
+    if (img.len > UINT32_MAX) {
+        printf("tsh: snapshot too large\n");
+        exit(1);
+    }
+    hdr.size = img.len;
+    memcpy(img.s, &hdr, sizeof(hdr));
+
+    if ((tmp = malloc(strlen(path) + 16)) == NULL)
+        unix_error("malloc error");
+    sprintf(tmp, "%s.%d", path, (int)getpid());
+    if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1) {
+        printf("%s: %s\n", tmp, strerror(errno));
+        exit(1);
+    }
+    for (done = 0; done < img.len; done += n) {
+        if ((n = write(fd, img.s + done, img.len - done)) == -1) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
             }
+            unix_error("snapshot write error");
         }
     }
-    return;
+    if (close(fd) == -1 || rename(tmp, path) == -1) {
+        printf("%s: %s\n", path, strerror(errno));
+        unlink(tmp);
+        exit(1);
+    }
+    free(tmp);
+    free(img.s);
+}
+
+/* snap_okrec - Is there room for an n byte record at off in the image? */
+static int snap_okrec(const struct snap_hdr *hdr, uint32_t off, size_t n) {
+    return off >= sizeof(*hdr) && off % 8 == 0 && off <= hdr->size &&
+           n <= hdr->size - off;
+}
 
+/* snap_okstr - Is there a string at off that ends inside the image? */
+static int snap_okstr(const struct snap_hdr *hdr, uint32_t off) {
+    return off >= sizeof(*hdr) && off < hdr->size &&
+           memchr((const char *)hdr + off, '\0', hdr->size - off) != NULL;
 }
 
+/* snap_off - Offset in the image of an address inside it, else 0 */
+static uint32_t snap_off(const struct snap_hdr *hdr, const void *p) {
+    uintptr_t base = (uintptr_t)hdr;
 
-/*****************
- * Signal handlers
- *****************/
+    return (uintptr_t)p > base && (uintptr_t)p - base < hdr->size ?
+           (uintptr_t)p - base : 0;
+}
 
-/* 
- * sigchld_handler - The kernel sends a SIGCHLD to the shell whenever
- *     a child job terminates (becomes a zombie), or stops because it
- *     received a SIGSTOP or SIGTSTP signal. The handler reaps all
- *     available zombie children, but doesn't wait for any other
- *     currently running children to terminate.  
+/*
+ * snap_oknodes - Does the node list at node, and everything under it,
+ *    lie inside the image with every node the parser could have made?
+ *    Each node uses up one of *budget, so a cycle runs out of them.
  */
-void sigchld_handler(int sig) {
-    pid_t reapedPID;
-    int status;
+static int snap_oknodes(const struct snap_hdr *hdr, const struct node_t *node,
+                        int depth, size_t *budget) {
+    int i;
 
-    while ((reapedPID = waitpid(-1, &status, WNOHANG | WUNTRACED | WCONTINUED)) > 0){
-        struct job_t *job = getjobpid(jobs, reapedPID);
-        if(WIFSTOPPED(status)){
-            job->state = ST;
-            printf("Job [%d] (%d) stopped by signal %d\n", job->jid, job->pid, SIGTSTP);
-            return;
-        }
-        if(WIFCONTINUED(status)){
-            return;
-        }
-        else{
-            // Child was either exited normally or was terminated
-            if(!WIFEXITED(status)){
-              printf("Job [%d] (%d) terminated by signal %d\n", job->jid, job->pid, WTERMSIG(status));
-            }
-            deletejob(jobs, reapedPID);
-            return;
+    if (depth > SNAP_DEPTH)
+        return 0;
+    for (; node; node = node->next) {
+        if (*budget == 0 || !snap_okrec(hdr, snap_off(hdr, node), sizeof(*node)))
+            return 0;
+        (*budget)--;
+        if (node->type < N_CMD || node->type > N_FUNC || node->cmd.argc < 0 ||
+            (node->type != N_IF && node->type != N_WHILE && node->cmd.argc == 0) ||
+            (node->type == N_CMD && !node->cmd.text) ||
+            (node->cmd.text && !snap_okstr(hdr, snap_off(hdr, node->cmd.text))) ||
+            !snap_oknodes(hdr, node->cond, depth + 1, budget) ||
+            !snap_oknodes(hdr, node->body, depth + 1, budget) ||
+            !snap_oknodes(hdr, node->alt, depth + 1, budget))
+            return 0;
+        if (node->cmd.argc) {
+            if (!snap_okrec(hdr, snap_off(hdr, node->cmd.argv),
+                            (node->cmd.argc + 1) * sizeof(char *)) ||
+                !snap_okrec(hdr, snap_off(hdr, node->cmd.lit), node->cmd.argc) ||
+                node->cmd.argv[node->cmd.argc])
+                return 0;
+            for (i = 0; i < node->cmd.argc; i++)
+                if (!snap_okstr(hdr, snap_off(hdr, node->cmd.argv[i])))
+                    return 0;
         }
     }
-return;
+    return 1;
 }
 
-/* 
- * sigint_handler - The kernel sends a SIGINT to the shell whenever the
- *    user types ctrl-c at the keyboard.  Catch it and send it along
- *    to the foreground job. - KAIRUI | TRACE 6,7
+/*
+ * snap_okdefs - Does the function or alias list at off lie inside the
+ *    image?
  */
-void sigint_handler(int sig) {
-    pid_t fgp = fgpid(jobs);
-    if(fgp != 0){
-        // struct job_t *job = getjobpid(jobs, fgp);
-        if(kill(-fgp, sig)==-1){
-            perror("sigint error");
-        }
+static int snap_okdefs(const struct snap_hdr *hdr, uint32_t off, size_t *budget) {
+    const struct snap_def *sd;
+
+    for (; off; off = sd->next) {
+        if (*budget == 0 || !snap_okrec(hdr, off, sizeof(*sd)))
+            return 0;
+        (*budget)--;
+        sd = (const struct snap_def *)((const char *)hdr + off);
+        if (!snap_okstr(hdr, sd->name) || (sd->text && !snap_okstr(hdr, sd->text)) ||
+            !snap_oknodes(hdr, snap_ptr(sd->ast), 0, budget))
+            return 0;
     }
-    return;
+    return 1;
 }
 
 /*
- * sigtstp_handler - The kernel sends a SIGTSTP to the shell whenever
- *     the user types ctrl-z at the keyboard. Catch it and suspend the
- *     foreground job by sending it a SIGTSTP. - GAO | TRACE 8
+ * snap_ok - Check, before anything in it is used, that every offset in
+ *    the image stays inside it and every string ends inside it. Records
+ *    are at least 8 bytes apiece, so no sound image has more than
+ *    size / 8 of them; that many visits is the most it can take.
  */
-void sigtstp_handler(int sig) {
-    pid_t fgp = fgpid(jobs);
-    if(fgp == 0){
-        return;
+static int snap_ok(const struct snap_hdr *hdr) {
+    const struct snap_var *sv;
+    const struct snap_script *ss;
+    size_t budget = hdr->size / 8;
+    uint32_t off;
+    int i;
+
+    if (!snap_okstr(hdr, hdr->rcpath))
+        return 0;
+    for (i = 0; i < VARHASH; i++) {
+        for (off = hdr->vars[i]; off; off = sv->next) {
+            if (budget == 0 || !snap_okrec(hdr, off, sizeof(*sv)))
+                return 0;
+            budget--;
+            sv = (const struct snap_var *)((const char *)hdr + off);
+            if (!snap_okstr(hdr, sv->name) || !snap_okstr(hdr, sv->value))
+                return 0;
+        }
     }
-    // struct job_t *job = getjobpid(jobs, fgp);
-    if(kill(-fgp, sig) == -1){
-        perror("sigtstp");
+    for (off = hdr->scripts; off; off = ss->next) {
+        if (budget == 0 || !snap_okrec(hdr, off, sizeof(*ss)))
+            return 0;
+        budget--;
+        ss = (const struct snap_script *)((const char *)hdr + off);
+        if (!snap_okstr(hdr, ss->path) ||
+            !snap_oknodes(hdr, snap_ptr(ss->ast), 0, &budget))
+            return 0;
     }
-    return;
+    return snap_okdefs(hdr, hdr->funcs, &budget) &&
+           snap_okdefs(hdr, hdr->aliases, &budget);
 }
 
 /*
- * sigusr1_handler - child is ready
+ * snap_fresh - Are the scripts the rc file sourced unchanged since the
+ *    image was written? Functions and variables they set are in it too.
  */
-void sigusr1_handler(int sig) {
-    ready = 1;
-}
+static int snap_fresh(const struct snap_hdr *hdr) {
+    const struct snap_script *ss;
+    struct stat st;
+    uint32_t off;
 
+    for (off = hdr->scripts; off; off = ss->next) {
+        ss = (const struct snap_script *)((const char *)hdr + off);
+        if (stat((const char *)hdr + ss->path, &st) == -1 ||
+            ss->size != st.st_size || ss->sec != st.st_mtim.tv_sec ||
+            ss->nsec != st.st_mtim.tv_nsec)
+            return 0;
+    }
+    return 1;
+}
 
-/*********************
- * End signal handlers
- *********************/
+/*
+ * load_snapshot - Map the image at path if it was written by this tsh
+ *    binary from the rc file and scripts as they are now, and is sound.
+ *    Returns 1 if it is in use. The mapping is writable but private:
+ *    a builtin may cut a word at its '=' for a moment, which costs a
+ *    copy of that page and never reaches the file.
+ */
+int load_snapshot(const char *path, const char *rc) {
+    struct snap_file id;
+    struct stat st;
+    const struct snap_hdr *hdr;
+    void *map;
+    int fd;
 
-/***********************************************
- * Helper routines that manipulate the job list
- **********************************************/
+    if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+        return 0;
+    if (fstat(fd, &st) == -1 || st.st_size < (off_t)sizeof(struct snap_hdr) ||
+        st.st_size > UINT32_MAX ||
+        (map = mmap((void *)SNAP_BASE, st.st_size, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_FIXED_NOREPLACE, fd, 0)) == MAP_FAILED) {
+        close(fd);
+        return 0;
+    }
+    close(fd);
+    if (map != (void *)SNAP_BASE) {     /* a kernel that only took the hint */
+        munmap(map, st.st_size);
+        return 0;
+    }
 
-/* clearjob - Clear the entries in a job struct */
-void clearjob(struct job_t *job) {
-    job->pid = 0;
-    job->jid = 0;
-    job->state = UNDEF;
-    job->cmdline[0] = '\0';
+    hdr = map;
+    if (memcmp(hdr->magic, SNAP_MAGIC, sizeof(hdr->magic)) != 0 ||
+        hdr->size != (uint64_t)st.st_size || hdr->varhash != VARHASH ||
+        !snap_ok(hdr) || !rc || strcmp((const char *)map + hdr->rcpath, rc) != 0 ||
+        snap_identify(rc, &id) == -1 || memcmp(&id, &hdr->rc, sizeof(id)) != 0 ||
+        snap_identify("/proc/self/exe", &id) == -1 ||
+        memcmp(&id, &hdr->exe, sizeof(id)) != 0 || !snap_fresh(hdr)) {
+        munmap(map, st.st_size);        /* stale or bad: run the rc file instead */
+        return 0;
+    }
+    snap = hdr;
+    snap_defs(hdr->funcs, functab);
+    snap_defs(hdr->aliases, aliastab);
+    return 1;
 }
 
-/* initjobs - Initialize the job list */
-void initjobs(struct job_t *jobs) {
-    int i;
+/* snap_getvar - Value of a variable in the snapshot, or NULL */
+const char *snap_getvar(const char *name) {
+    const struct snap_var *v;
+    uint32_t off;
 
-    for (i = 0; i < MAXJOBS; i++)
-        clearjob(&jobs[i]);
+    if (!snap)
+        return NULL;
+    for (off = snap->vars[varhash(name)]; off; off = v->next) {
+        v = (const struct snap_var *)SNAP_AT(off);
+        if (strcmp(SNAP_AT(v->name), name) == 0)
+            return SNAP_AT(v->value);
+    }
+    return NULL;
 }
 
-/* freejid - Returns smallest free job ID */
-int freejid(struct job_t *jobs) {
-    int i;
-    int taken[MAXJOBS + 1] = {0};
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid != 0) 
-        taken[jobs[i].jid] = 1;
-    for (i = 1; i <= MAXJOBS; i++)
-        if (!taken[i])
-            return i;
-    return 0;
-}
+/*
+ * snap_defs - Enter the functions or aliases in the image list at off
+ *    into tab. The entries are new, since unalias and redefinitions
+ *    need them in the table, but their trees stay in the image.
+ */
+void snap_defs(uint32_t off, struct def_t **tab) {
+    const struct snap_def *sd;
 
-/* addjob - Add a job to the job list */
-int addjob(struct job_t *jobs, pid_t pid, int state, char *cmdline) {
-    int i;
-    
-    if (pid < 1)
-        return 0;
-    int free = freejid(jobs);
-    if (!free) {
-        printf("Tried to create too many jobs\n");
-        return 0;
-    }
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == 0) {
-            jobs[i].pid = pid;
-            jobs[i].state = state;
-            jobs[i].jid = free;
-            strcpy(jobs[i].cmdline, cmdline);
-            if(verbose){
-                printf("Added job [%d] %d %s\n", jobs[i].jid, jobs[i].pid, jobs[i].cmdline);
-            }
-            return 1;
-        }
+    for (; off; off = sd->next) {
+        sd = (const struct snap_def *)SNAP_AT(off);
+        setdef(tab, SNAP_AT(sd->name), snap_ptr(sd->ast),
+               sd->text ? SNAP_AT(sd->text) : NULL);
     }
-    return 0; /*suppress compiler warning*/
 }
 
-/* deletejob - Delete a job whose PID=pid from the job list */
-int deletejob(struct job_t *jobs, pid_t pid) {
-    int i;
-
-    if (pid < 1)
-        return 0;
+/*
+ * snap_script - The parsed tree of the script at path from the
+ *    snapshot, if it was taken from the file as it is now (st).
+ */
+struct node_t *snap_script(const char *path, struct stat *st) {
+    const struct snap_script *ss;
+    uint32_t off;
 
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid == pid) {
-            clearjob(&jobs[i]);
-            return 1;
-        }
+    if (!snap)
+        return NULL;
+    for (off = snap->scripts; off; off = ss->next) {
+        ss = (const struct snap_script *)SNAP_AT(off);
+        if (strcmp(SNAP_AT(ss->path), path) == 0)
+            return ss->size == st->st_size && ss->sec == st->st_mtim.tv_sec &&
+                   ss->nsec == st->st_mtim.tv_nsec ? snap_ptr(ss->ast) : NULL;
     }
-    return 0;
+    return NULL;
 }
 
-/* fgpid - Return PID of current foreground job, 0 if no such job */
-pid_t fgpid(struct job_t *jobs) {
-    int i;
+/***********************
+ * Other helper routines
+ ***********************/
 
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].state == FG)
-            return jobs[i].pid;
-    return 0;
+/*
+ * sb_grow - Make room for n more characters plus the terminator
+ */
+void sb_grow(struct strbuf_t *sb, size_t n) {
+    if (sb->len + n + 1 > sb->cap) {
+        sb->cap = sb->cap ? 2 * sb->cap : 64;
+        if (sb->cap < sb->len + n + 1)
+            sb->cap = sb->len + n + 1;
+        if ((sb->s = realloc(sb->s, sb->cap)) == NULL)
+            unix_error("realloc error");
+    }
 }
 
-/* getjobpid  - Find a job (by PID) on the job list */
-struct job_t *getjobpid(struct job_t *jobs, pid_t pid) {
-    int i;
+/*
+ * sb_putc - Append a character to a growable string
+ */
+void sb_putc(struct strbuf_t *sb, char c) {
+    sb_grow(sb, 1);
+    sb->s[sb->len++] = c;
+    sb->s[sb->len] = '\0';
+}
 
-    if (pid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid)
-            return &jobs[i];
-    return NULL;
+/*
+ * sb_puts - Append a string to a growable string
+ */
+void sb_puts(struct strbuf_t *sb, const char *str) {
+    sb_putn(sb, str, strlen(str));
 }
 
-/* getjobjid  - Find a job (by JID) on the job list */
-struct job_t *getjobjid(struct job_t *jobs, int jid) 
-{
-    int i;
+/*
+ * sb_putn - Append the first n characters of str to a growable string
+ */
+void sb_putn(struct strbuf_t *sb, const char *str, size_t n) {
+    sb_grow(sb, n);
+    memcpy(sb->s + sb->len, str, n);
+    sb->len += n;
+    sb->s[sb->len] = '\0';
+}
 
-    if (jid < 1)
-        return NULL;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].jid == jid)
-            return &jobs[i];
-    return NULL;
+/*
+ * sb_finish - Hand over the string, which is never NULL
+ */
+char *sb_finish(struct strbuf_t *sb) {
+    sb_grow(sb, 0);
+    sb->s[sb->len] = '\0';
+    return sb->s;
 }
 
-/* pid2jid - Map process ID to job ID */
-int pid2jid(pid_t pid) {
+/*
+ * join_argv - Join argc words with spaces into a malloc'd, newline
+ *    terminated command line
+ */
+char *join_argv(char **argv, int argc) {
+    struct strbuf_t sb = {0};
     int i;
 
-    if (pid < 1)
-        return 0;
-    for (i = 0; i < MAXJOBS; i++)
-        if (jobs[i].pid == pid) {
-            return jobs[i].jid;
+    for (i = 0; i < argc; i++) {
+        if (i)
+            sb_putc(&sb, ' ');
+        sb_puts(&sb, argv[i]);
     }
-    return 0;
+    sb_putc(&sb, '\n');
+    return sb.s;
 }
 
-/* listjobs - Print the job list */
-void listjobs(struct job_t *jobs) {
-    int i;
-    
-    for (i = 0; i < MAXJOBS; i++) {
-        if (jobs[i].pid != 0) {
-            printf("[%d] (%d) ", jobs[i].jid, jobs[i].pid);
-            switch (jobs[i].state) {
-                case BG: 
-                    printf("Running ");
-                    break;
-                case FG: 
-                    printf("Foreground ");
-                    break;
-                case ST: 
-                    printf("Stopped ");
-                    break;
-                default:
-                    printf("listjobs: Internal error: job[%d].state=%d ", 
-                       i, jobs[i].state);
+/*
+ * read_line - Append the next line of input, newline included, to line.
+ *    Returns the number of characters appended, 0 at end of file.
+ *    While waiting for input, expired timers are run and pending jobs
+ *    whose prerequisites have finished are launched.
+ */
+int read_line(struct strbuf_t *line) {
+    static struct strbuf_t in;  /* read but not yet returned */
+    static size_t pos;
+    static int eof;
+    struct pollfd pfd[2];
+    sigset_t old;
+    char *nl;
+    size_t n;
+    ssize_t got;
+    int rc;
+
+    while (1) {
+        nl = pos < in.len ? memchr(in.s + pos, '\n', in.len - pos) : NULL;
+        if (nl || (eof && pos < in.len)) {
+            n = nl ? (size_t)(nl - (in.s + pos)) + 1 : in.len - pos;
+            sb_grow(line, n);
+            memcpy(line->s + line->len, in.s + pos, n);
+            line->len += n;
+            line->s[line->len] = '\0';
+            pos += n;
+            return n;
+        }
+        if (eof)
+            return 0;
+
+        if (pos > 0) {              /* keep only the partial line */
+            memmove(in.s, in.s + pos, in.len - pos);
+            in.len -= pos;
+            pos = 0;
+        }
+
+        pfd[0].fd = STDIN_FILENO;
+        pfd[0].events = POLLIN;
+        pfd[1].fd = timer_fd;
+        pfd[1].events = POLLIN;
+        block_sigchld(&old);        /* a job finishing wakes the ppoll */
+        if (ready_jobs)
+            launch_ready();
+        if (perf_done)
+            report_perf();
+        rc = ppoll(pfd, 2, NULL, &old);
+        sigprocmask(SIG_SETMASK, &old, NULL);
+        if (rc == -1) {
+            if (errno == EINTR)
+                continue;
+            unix_error("poll error");
+        }
+        if (pfd[1].revents & POLLIN)
+            run_timers();
+        if (pfd[0].revents) {
+            sb_grow(&in, 4096);
+            got = read(STDIN_FILENO, in.s + in.len, 4096);
+            if (got == -1) {
+                if (errno == EINTR)
+                    continue;
+                unix_error("read error");
             }
-            printf("%s", jobs[i].cmdline);
+            if (got == 0)
+                eof = 1;
+            in.len += got;
         }
     }
 }
-/******************************
- * end job list helper routines
- ******************************/
-
-
-/***********************
- * Other helper routines
- ***********************/
 
 /*
  * usage - print a help message and terminate
  */
 void usage(void) {
-    printf("Usage: shell [-hvp]\n");
+    printf("Usage: shell [-hvp] [--snapshot FILE]\n");
     printf("   -h   print this message\n");
     printf("   -v   print additional diagnostic information\n");
     printf("   -p   do not emit a command prompt\n");
+    printf("   --snapshot FILE  run the rc file, save the resulting state\n");
+    printf("        in FILE and exit; with TSH_SNAPSHOT=FILE later shells\n");
+    printf("        start from it instead of the rc file\n");
     exit(1);
 }
 
+/*
+ * notify - printf for job notices, which belong on the terminal even
+ *    while an in-process $(...) is capturing stdout
+ */
+void notify(const char *fmt, ...) {
+    va_list ap;
+
+    va_start(ap, fmt);
+    if (notice_fd == -1)
+        vprintf(fmt, ap);
+    else
+        vdprintf(notice_fd, fmt, ap);
+    va_end(ap);
+}
+
 /*
  * unix_error - unix-style error routine
  */